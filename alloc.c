@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alloc.h"
+
+#if ALLOC_STATS
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef reallocarray
+#undef strdup
+#undef strndup
+#undef asprintf
+#undef free
+
+#define ALLOC_MAGIC	0xa110c8ed
+#define MAX_SITES	64
+
+struct alloc_site {
+	const char *file;
+	int line;
+	const char *func;
+	unsigned long count;
+	unsigned long bytes;
+	unsigned long total_count;
+	unsigned long total_bytes;
+};
+
+/* prepended to every allocation so free() and realloc() know its size */
+struct alloc_header {
+	uint32_t magic;
+	uint32_t site;
+	size_t size;
+} __attribute__((aligned(16)));
+
+static struct alloc_site sites[MAX_SITES];
+static int nsites = 0;
+static unsigned long live_count = 0, live_bytes = 0;
+static unsigned long reports = 0;
+
+static void *	json_malloc(size_t size);
+static void *	json_realloc(void *ptr, size_t size);
+
+json_allocator alloc_json_allocator = {
+	json_malloc,
+	json_realloc,
+	alloc_free,
+};
+
+static int
+alloc_site(const char *file, int line, const char *func)
+{
+	int i;
+
+	for (i = 0; i < nsites; i++) {
+		if (sites[i].line == line && sites[i].file == file)
+			return i;
+	}
+
+	if (nsites == MAX_SITES)
+		errx(1, "too many allocation sites, raise MAX_SITES");
+
+	sites[nsites].file = file;
+	sites[nsites].line = line;
+	sites[nsites].func = func;
+	return nsites++;
+}
+
+static void
+alloc_account(int site, size_t size)
+{
+	sites[site].count++;
+	sites[site].bytes += size;
+	sites[site].total_count++;
+	sites[site].total_bytes += size;
+}
+
+void *
+alloc_malloc(size_t size, const char *file, int line, const char *func)
+{
+	struct alloc_header *h;
+	int site;
+
+	h = malloc(sizeof(struct alloc_header) + size);
+	if (h == NULL)
+		return NULL;
+
+	site = alloc_site(file, line, func);
+	alloc_account(site, size);
+	live_count++;
+	live_bytes += size;
+
+	h->magic = ALLOC_MAGIC;
+	h->site = site;
+	h->size = size;
+	return h + 1;
+}
+
+void *
+alloc_calloc(size_t nmemb, size_t size, const char *file, int line,
+    const char *func)
+{
+	void *ret;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	ret = alloc_malloc(nmemb * size, file, line, func);
+	if (ret != NULL)
+		memset(ret, 0, nmemb * size);
+	return ret;
+}
+
+void *
+alloc_realloc(void *ptr, size_t size, const char *file, int line,
+    const char *func)
+{
+	struct alloc_header *h, *nh;
+	int site;
+
+	if (ptr == NULL)
+		return alloc_malloc(size, file, line, func);
+
+	h = (struct alloc_header *)ptr - 1;
+	if (h->magic != ALLOC_MAGIC)
+		errx(1, "%s:%d: realloc of untracked pointer", file, line);
+
+	live_bytes -= h->size;
+	nh = realloc(h, sizeof(struct alloc_header) + size);
+	if (nh == NULL) {
+		live_bytes += h->size;
+		return NULL;
+	}
+
+	site = alloc_site(file, line, func);
+	alloc_account(site, size);
+	live_bytes += size;
+
+	nh->site = site;
+	nh->size = size;
+	return nh + 1;
+}
+
+void *
+alloc_reallocarray(void *ptr, size_t nmemb, size_t size, const char *file,
+    int line, const char *func)
+{
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	return alloc_realloc(ptr, nmemb * size, file, line, func);
+}
+
+char *
+alloc_strdup(const char *str, const char *file, int line, const char *func)
+{
+	size_t len = strlen(str) + 1;
+	char *ret;
+
+	ret = alloc_malloc(len, file, line, func);
+	if (ret != NULL)
+		memcpy(ret, str, len);
+	return ret;
+}
+
+char *
+alloc_strndup(const char *str, size_t max, const char *file, int line,
+    const char *func)
+{
+	size_t len = strnlen(str, max);
+	char *ret;
+
+	ret = alloc_malloc(len + 1, file, line, func);
+	if (ret != NULL) {
+		memcpy(ret, str, len);
+		ret[len] = '\0';
+	}
+	return ret;
+}
+
+int
+alloc_asprintf(const char *file, int line, const char *func, char **ret,
+    const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return -1;
+
+	*ret = alloc_malloc(len + 1, file, line, func);
+	if (*ret == NULL)
+		return -1;
+
+	va_start(ap, fmt);
+	vsnprintf(*ret, len + 1, fmt, ap);
+	va_end(ap);
+	return len;
+}
+
+void
+alloc_free(void *ptr)
+{
+	struct alloc_header *h;
+
+	if (ptr == NULL)
+		return;
+
+	h = (struct alloc_header *)ptr - 1;
+	if (h->magic != ALLOC_MAGIC)
+		errx(1, "free of untracked pointer %p", ptr);
+
+	h->magic = 0;
+	live_count--;
+	live_bytes -= h->size;
+	free(h);
+}
+
+void
+alloc_count(size_t size, const char *file, int line, const char *func)
+{
+	alloc_account(alloc_site(file, line, func), size);
+}
+
+static void *
+json_malloc(size_t size)
+{
+	return alloc_malloc(size, "pdjson.c", 0, "pdjson");
+}
+
+static void *
+json_realloc(void *ptr, size_t size)
+{
+	return alloc_realloc(ptr, size, "pdjson.c", 0, "pdjson");
+}
+
+void
+alloc_report(const char *label)
+{
+	unsigned long count = 0, bytes = 0;
+	int i;
+
+	for (i = 0; i < nsites; i++) {
+		count += sites[i].count;
+		bytes += sites[i].bytes;
+	}
+
+	fprintf(stderr, "alloc[%lu] %s: %lu allocation%s, %lu byte%s "
+	    "(%lu live, %lu byte%s)\n", reports++, label,
+	    count, count == 1 ? "" : "s", bytes, bytes == 1 ? "" : "s",
+	    live_count, live_bytes, live_bytes == 1 ? "" : "s");
+
+	for (i = 0; i < nsites; i++) {
+		if (sites[i].count == 0)
+			continue;
+
+		fprintf(stderr, "  %s:%d %s: %lu (%lu bytes), "
+		    "total %lu (%lu bytes)\n", sites[i].file, sites[i].line,
+		    sites[i].func, sites[i].count, sites[i].bytes,
+		    sites[i].total_count, sites[i].total_bytes);
+
+		sites[i].count = 0;
+		sites[i].bytes = 0;
+	}
+}
+
+#endif
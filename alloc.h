@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ALLOC_H__
+#define __ALLOC_H__
+
+/*
+ * When built with -DALLOC_STATS=1, every allocation and free in a file that
+ * includes this header (after its system headers) is routed through counting
+ * wrappers tagged by file and line, and alloc_report() prints what was
+ * allocated since the last report.  Otherwise this all compiles away.
+ */
+
+#if ALLOC_STATS
+
+#include <stdlib.h>
+
+#include "pdjson.h"
+
+void *	alloc_malloc(size_t size, const char *file, int line,
+	    const char *func);
+void *	alloc_calloc(size_t nmemb, size_t size, const char *file, int line,
+	    const char *func);
+void *	alloc_realloc(void *ptr, size_t size, const char *file, int line,
+	    const char *func);
+void *	alloc_reallocarray(void *ptr, size_t nmemb, size_t size,
+	    const char *file, int line, const char *func);
+char *	alloc_strdup(const char *str, const char *file, int line,
+	    const char *func);
+char *	alloc_strndup(const char *str, size_t max, const char *file, int line,
+	    const char *func);
+int	alloc_asprintf(const char *file, int line, const char *func,
+	    char **ret, const char *fmt, ...)
+	    __attribute__((format(printf, 5, 6)));
+void	alloc_free(void *ptr);
+void	alloc_count(size_t size, const char *file, int line, const char *func);
+void	alloc_report(const char *label);
+
+extern json_allocator alloc_json_allocator;
+
+#define malloc(s)		alloc_malloc((s), __FILE__, __LINE__, __func__)
+#define calloc(n, s)		alloc_calloc((n), (s), __FILE__, __LINE__, \
+				    __func__)
+#define realloc(p, s)		alloc_realloc((p), (s), __FILE__, __LINE__, \
+				    __func__)
+#define reallocarray(p, n, s)	alloc_reallocarray((p), (n), (s), __FILE__, \
+				    __LINE__, __func__)
+#define strdup(s)		alloc_strdup((s), __FILE__, __LINE__, __func__)
+#define strndup(s, n)		alloc_strndup((s), (n), __FILE__, __LINE__, \
+				    __func__)
+#define asprintf(r, ...)	alloc_asprintf(__FILE__, __LINE__, __func__, \
+				    (r), __VA_ARGS__)
+#define free(p)			alloc_free(p)
+
+/* for memory handed to us by libraries such as Xlib */
+#define ALLOC_COUNT(s)		alloc_count((s), __FILE__, __LINE__, __func__)
+#define ALLOC_REPORT(l)		alloc_report(l)
+#define ALLOC_JSON(js)		json_set_allocator((js), &alloc_json_allocator)
+
+#else
+
+#define ALLOC_COUNT(s)		do { } while (0)
+#define ALLOC_REPORT(l)		do { } while (0)
+#define ALLOC_JSON(js)		do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "store.h"
+
+/*
+ * The last observation for each location is kept in a small file under
+ * $XDG_CACHE_HOME/xweathericon (or ~/.cache/xweathericon) so that every
+ * instance and every one-shot invocation on the host shares one API call per
+ * interval.  When the shared memory store is available it sits in front of
+ * the file, so reads of a fresh observation don't touch the filesystem and
+ * fetches are coordinated through its lease instead of flock(2).
+ */
+
+#define CACHE_MAGIC	0x78776931	/* "xwi1" */
+
+/* returned by cache_lock when coordinating through the store's lease */
+#define CACHE_LEASED	-2
+
+/* how long a fetch may hold the lease before others give up on it */
+#define CACHE_LEASE_SECS	60
+
+static int store = -1;
+
+struct cache_file {
+	unsigned int magic;
+	unsigned int size;
+	struct observation obs;
+};
+
+static int	cache_read_file(const char *key, struct observation *obs);
+
+int
+cache_path(const char *key, const char *ext, char *path, size_t len)
+{
+	const char *base, *home;
+	char dir[PATH_MAX];
+	size_t n;
+	int i;
+
+	if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0] != '\0')
+		n = snprintf(dir, sizeof(dir), "%s/xweathericon", base);
+	else if ((home = getenv("HOME")) != NULL && home[0] != '\0')
+		n = snprintf(dir, sizeof(dir), "%s/.cache/xweathericon", home);
+	else
+		return -1;
+	if (n >= sizeof(dir))
+		return -1;
+
+	n = snprintf(path, len, "%s/%s%s", dir, key, ext);
+	if (n >= len)
+		return -1;
+
+	/* keys come from the command line, don't let them wander */
+	for (i = strlen(dir) + 1; path[i] != '\0'; i++) {
+		if (path[i] == '/')
+			path[i] = '_';
+	}
+
+	if (access(dir, F_OK) == 0)
+		return 0;
+
+	/* mkdir -p, tolerating races with other instances */
+	for (i = 1; dir[i] != '\0'; i++) {
+		if (dir[i] != '/')
+			continue;
+		dir[i] = '\0';
+		if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+			return -1;
+		dir[i] = '/';
+	}
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+void
+cache_open(void)
+{
+	store = store_open();
+}
+
+int
+cache_read(const char *key, struct observation *obs)
+{
+	if (store == 0 && store_read(key, obs) == 0)
+		return 0;
+
+	return cache_read_file(key, obs);
+}
+
+/*
+ * When the observation in key's cache file was made, or 0 without one.  The
+ * file, unlike the shared memory store, is seen by every host sharing the
+ * cache directory.
+ */
+time_t
+cache_time(const char *key)
+{
+	struct observation obs;
+
+	if (cache_read_file(key, &obs) != 0)
+		return 0;
+
+	return obs.time;
+}
+
+static int
+cache_read_file(const char *key, struct observation *obs)
+{
+	struct cache_file cf;
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	if (cache_path(key, "", path, sizeof(path)) != 0)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	len = read(fd, &cf, sizeof(cf));
+	close(fd);
+
+	if (len != sizeof(cf) || cf.magic != CACHE_MAGIC ||
+	    cf.size != sizeof(cf))
+		return -1;
+
+	cf.obs.description[sizeof(cf.obs.description) - 1] = '\0';
+	memcpy(obs, &cf.obs, sizeof(struct observation));
+	return 0;
+}
+
+void
+cache_write(const char *key, const struct observation *obs)
+{
+	struct cache_file cf;
+	char path[PATH_MAX], tpath[PATH_MAX];
+	int fd;
+
+	if (cache_path(key, "", path, sizeof(path)) != 0)
+		return;
+	if (snprintf(tpath, sizeof(tpath), "%s.%d", path, getpid()) >=
+	    sizeof(tpath))
+		return;
+
+	if (store == 0)
+		store_write(key, obs);
+
+	memset(&cf, 0, sizeof(cf));
+	cf.magic = CACHE_MAGIC;
+	cf.size = sizeof(cf);
+	memcpy(&cf.obs, obs, sizeof(struct observation));
+
+	/* write and rename so readers never see a partial file */
+	fd = open(tpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		warn("failed creating cache file %s", tpath);
+		return;
+	}
+	if (write(fd, &cf, sizeof(cf)) != sizeof(cf)) {
+		warn("failed writing cache file %s", tpath);
+		close(fd);
+		unlink(tpath);
+		return;
+	}
+	close(fd);
+
+	if (rename(tpath, path) == -1) {
+		warn("failed renaming %s to %s", tpath, path);
+		unlink(tpath);
+	}
+}
+
+/*
+ * Serialize fetches for a key across processes, so when the cache goes stale
+ * only the first caller fetches and the rest wait and read its result.
+ */
+int
+cache_lock(const char *key)
+{
+	struct observation obs;
+	char path[PATH_MAX];
+	int fd;
+
+	if (store == 0) {
+		while (!store_lease(key, CACHE_LEASE_SECS))
+			store_wait(key, &obs, CACHE_LEASE_SECS);
+		return CACHE_LEASED;
+	}
+
+	if (cache_path(key, ".lock", path, sizeof(path)) != 0)
+		return -1;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -1;
+
+	if (flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+void
+cache_unlock(const char *key, int fd)
+{
+	if (fd == CACHE_LEASED) {
+		store_release(key);
+		return;
+	}
+	if (fd == -1)
+		return;
+
+	flock(fd, LOCK_UN);
+	close(fd);
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "pdjson.h"
+#include "forecast.h"
+#include "pool.h"
+#include "alloc.h"
+
+#define MAX_DEPTH	6
+
+/* bodies at least this big have their list[] elements parsed on threads */
+#define SPLIT_MIN	(64 * 1024)
+
+struct forecast_split {
+	const char *buf;
+	size_t starts[FORECAST_MAX];
+	size_t ends[FORECAST_MAX];
+	struct forecast *fc;
+	int failed;
+	char error[128];
+};
+
+static int parse_threads = 1;
+
+static int	forecast_read(struct http_request *req, struct forecast *fc);
+static int	forecast_split(const char *buf, size_t len,
+		    struct forecast *fc);
+static void	forecast_step(void *arg, int n);
+static void	forecast_value(json_stream *js, enum json_type jt,
+		    size_t depth, char (*keys)[16], struct forecast *fc, int n);
+
+int
+forecast_fetch(const char *url, struct forecast *fc)
+{
+	return forecast_read(http_get(url), fc);
+}
+
+/* a recorded response, for benchmarking */
+int
+forecast_replay(const char *path, struct forecast *fc)
+{
+	return forecast_read(http_file_open(path), fc);
+}
+
+static int
+forecast_read(struct http_request *req, struct forecast *fc)
+{
+	char *body;
+	size_t len;
+	int ret;
+
+	if (req == NULL)
+		return 1;
+
+	if (http_req_skip_header(req) != 1) {
+		warnx("failed reading HTTP body");
+		http_req_free(req);
+		return 1;
+	}
+
+	body = http_req_body(req, &len, FORECAST_MAX_BODY);
+	http_req_free(req);
+	if (body == NULL)
+		return 1;
+
+	ret = forecast_parse(body, len, fc);
+	free(body);
+
+	return ret;
+}
+
+/* parse the list[] of big enough bodies on up to this many threads */
+void
+forecast_parse_threads(int threads)
+{
+	parse_threads = threads;
+}
+
+/* https://openweathermap.org/forecast5#JSON */
+int
+forecast_parse(const char *buf, size_t len, struct forecast *fc)
+{
+	json_stream js;
+	enum json_type jt, ctx;
+	const char *str;
+	char keys[MAX_DEPTH + 1][16];
+	size_t depth, count, pos;
+	int n, split = (parse_threads > 1 && len >= SPLIT_MIN);
+
+again:
+	memset(fc, 0, sizeof(struct forecast));
+	memset(keys, 0, sizeof(keys));
+	n = -1;
+
+	json_open_buffer(&js, buf, len);
+	ALLOC_JSON(&js);
+	for (; jt = json_next(&js), jt != JSON_DONE && jt != JSON_ERROR;) {
+		depth = json_get_depth(&js);
+		if (depth > MAX_DEPTH)
+			continue;
+		ctx = json_get_context(&js, &count);
+
+		/* remember the key that each value at this depth is under */
+		if (jt == JSON_STRING && ctx == JSON_OBJECT && (count & 1)) {
+			str = json_get_string(&js, NULL);
+			snprintf(keys[depth], sizeof(keys[depth]), "%s", str);
+			continue;
+		}
+
+		if (strcmp(keys[1], "list") != 0)
+			continue;
+
+		/* the list[] itself, just opened */
+		if (jt == JSON_ARRAY && depth == 2 && split) {
+			pos = json_get_position(&js) - 1;
+			json_close(&js);
+			n = forecast_split(buf + pos, len - pos, fc);
+			if (n == -2) {
+				/* not all steps, so it has to be one pass */
+				split = 0;
+				goto again;
+			}
+			if (n == -1)
+				return 1;
+			n--;
+			goto done;
+		}
+
+		/* list[] element */
+		if (jt == JSON_OBJECT && depth == 3) {
+			if (n + 1 == FORECAST_MAX)
+				break;
+			n++;
+			continue;
+		}
+		if (n < 0)
+			continue;
+
+		forecast_value(&js, jt, depth - 2, keys + 2, fc, n);
+	}
+
+	if (json_get_error(&js)) {
+		warnx("failed parsing forecast: %s", json_get_error(&js));
+		json_close(&js);
+		return 1;
+	}
+	json_close(&js);
+
+done:
+	fc->count = n + 1;
+	fc->fetched = time(NULL);
+
+	return (fc->count == 0);
+}
+
+/*
+ * Find where each list[] element starts and ends in buf, which starts at the
+ * list, and parse each on its own stream and thread straight into its step of
+ * fc, returning how many there were, -1 on error, or -2 if anything but
+ * objects was in the way of numbering the steps
+ */
+static int
+forecast_split(const char *buf, size_t len, struct forecast *fc)
+{
+	struct forecast_split *split;
+	size_t n, i;
+	int count;
+
+	split = calloc(1, sizeof(struct forecast_split));
+	if (split == NULL)
+		err(1, "calloc");
+	split->buf = buf;
+	split->fc = fc;
+
+	n = json_split_array(buf, len, split->starts, split->ends,
+	    FORECAST_MAX);
+	if (n == (size_t)-1) {
+		warnx("failed parsing forecast: unterminated list");
+		free(split);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (buf[split->starts[i]] != '{') {
+			free(split);
+			return -2;
+		}
+	}
+	count = n;
+
+	pool_run(parse_threads, count, forecast_step, split);
+
+	if (split->failed) {
+		warnx("failed parsing forecast: %s", split->error);
+		count = -1;
+	}
+	free(split);
+
+	return count;
+}
+
+/* parse one list[] element, on a pool thread */
+static void
+forecast_step(void *arg, int n)
+{
+	struct forecast_split *split = arg;
+	json_stream js;
+	enum json_type jt, ctx;
+	const char *str;
+	char keys[MAX_DEPTH - 1][16];
+	size_t depth, count;
+
+	memset(keys, 0, sizeof(keys));
+
+	json_open_buffer(&js, split->buf + split->starts[n],
+	    split->ends[n] - split->starts[n]);
+	ALLOC_JSON(&js);
+	for (; jt = json_next(&js), jt != JSON_DONE && jt != JSON_ERROR;) {
+		depth = json_get_depth(&js);
+		if (depth > MAX_DEPTH - 2)
+			continue;
+		ctx = json_get_context(&js, &count);
+
+		if (jt == JSON_STRING && ctx == JSON_OBJECT && (count & 1)) {
+			str = json_get_string(&js, NULL);
+			snprintf(keys[depth], sizeof(keys[depth]), "%s", str);
+			continue;
+		}
+
+		forecast_value(&js, jt, depth, keys, split->fc, n);
+	}
+
+	/* only the first error is kept */
+	if (json_get_error(&js) &&
+	    !__atomic_exchange_n(&split->failed, 1, __ATOMIC_ACQ_REL))
+		snprintf(split->error, sizeof(split->error), "%s",
+		    json_get_error(&js));
+	json_close(&js);
+}
+
+/*
+ * Store a value from within list[] element n, with depth and keys counted
+ * from the element itself
+ */
+static void
+forecast_value(json_stream *js, enum json_type jt, size_t depth,
+    char (*keys)[16], struct forecast *fc, int n)
+{
+	const char *str;
+
+	if (jt == JSON_NUMBER && depth == 1 && strcmp(keys[1], "dt") == 0)
+		fc->times[n] = (int64_t)json_get_number(js);
+	else if (jt == JSON_NUMBER && depth == 2 &&
+	    strcmp(keys[1], "main") == 0 && strcmp(keys[2], "temp") == 0)
+		fc->temps[n] = (int16_t)(json_get_number(js) * 10);
+	else if (depth == 3 && strcmp(keys[1], "weather") == 0) {
+		/* only the first, primary condition */
+		if (jt == JSON_NUMBER && strcmp(keys[3], "id") == 0 &&
+		    fc->ids[n] == 0)
+			fc->ids[n] = (uint16_t)json_get_number(js);
+		else if (jt == JSON_STRING && strcmp(keys[3], "icon") == 0) {
+			/* "13d" or "04n" */
+			str = json_get_string(js, NULL);
+			if (strlen(str) > 2 && str[2] == 'n')
+				/* steps may be parsed on different threads */
+				__atomic_fetch_or(&fc->night, 1ULL << n,
+				    __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* whether two forecasts would draw the same */
+int
+forecast_equal(const struct forecast *a, const struct forecast *b)
+{
+	return (a->count == b->count && a->night == b->night &&
+	    memcmp(a->times, b->times, sizeof(a->times[0]) * a->count) == 0 &&
+	    memcmp(a->temps, b->temps, sizeof(a->temps[0]) * a->count) == 0 &&
+	    memcmp(a->ids, b->ids, sizeof(a->ids[0]) * a->count) == 0);
+}
+
+/*
+ * The forecast temperature at time t, linear between steps.  The first step
+ * is up to 3 hours out, so the first segment is extended back one step to
+ * cover the time of the current observation.
+ */
+int
+forecast_temp_at(const struct forecast *fc, time_t t, double *temp)
+{
+	double frac;
+	int i;
+
+	if (fc->count < 2)
+		return -1;
+	if (t < fc->times[0] - (fc->times[1] - fc->times[0]) ||
+	    t > fc->times[fc->count - 1])
+		return -1;
+
+	for (i = 0; i < fc->count - 2 && t >= fc->times[i + 1]; i++)
+		;
+	if (fc->times[i + 1] <= fc->times[i])
+		return -1;
+
+	frac = (double)(t - fc->times[i]) / (fc->times[i + 1] - fc->times[i]);
+	*temp = (fc->temps[i] + (fc->temps[i + 1] - fc->temps[i]) * frac) /
+	    10.0;
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FORECAST_H__
+#define __FORECAST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* 5 days of 3-hour steps, which is all the free API offers */
+#define FORECAST_MAX		40
+
+/* how often to refresh it, new steps only appear every 3 hours */
+#define FORECAST_CHECK_SECS	(60 * 60 * 3)
+
+/* with room for bulk responses carrying much more about each step */
+#define FORECAST_MAX_BODY	(16 * 1024 * 1024)
+
+/* stored as separate arrays so each can be scanned or copied on its own */
+struct forecast {
+	int count;
+	time_t fetched;
+	int64_t times[FORECAST_MAX];
+	int16_t temps[FORECAST_MAX];	/* tenths of a degree */
+	uint16_t ids[FORECAST_MAX];	/* openweathermap condition codes */
+	uint64_t night;			/* bit per step */
+};
+
+int	forecast_fetch(const char *url, struct forecast *fc);
+int	forecast_replay(const char *path, struct forecast *fc);
+void	forecast_parse_threads(int threads);
+int	forecast_parse(const char *buf, size_t len, struct forecast *fc);
+int	forecast_equal(const struct forecast *a, const struct forecast *b);
+int	forecast_temp_at(const struct forecast *fc, time_t t, double *temp);
+
+#endif
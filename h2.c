@@ -0,0 +1,1372 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http.h"
+#include "h2.h"
+#include "alloc.h"
+
+/*
+ * Just enough of HTTP/2 (RFC 9113) to make GET requests, so that everything
+ * we ask of one API host shares a single TLS connection and is in flight at
+ * the same time, rather than each request waiting its turn or opening a
+ * connection of its own.  Responses are collected in memory and handed back
+ * looking like HTTP/1 ones, so nothing reading them knows the difference.
+ *
+ * Request headers are compressed with HPACK (RFC 7541).  The host, user agent
+ * and accept headers go into the server's dynamic table with the first
+ * request on a connection, after which each costs a single byte, leaving the
+ * path as the only thing sent in full.
+ */
+
+extern char *__progname;
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_HEADER		9
+
+/* frame types */
+#define H2_DATA			0x0
+#define H2_HEADERS		0x1
+#define H2_RST_STREAM		0x3
+#define H2_SETTINGS		0x4
+#define H2_PUSH_PROMISE		0x5
+#define H2_PING			0x6
+#define H2_GOAWAY		0x7
+#define H2_WINDOW_UPDATE	0x8
+#define H2_CONTINUATION		0x9
+
+/* frame flags */
+#define H2_END_STREAM		0x1
+#define H2_ACK			0x1
+#define H2_END_HEADERS		0x4
+#define H2_PADDED		0x8
+#define H2_PRIORITY		0x20
+
+/* settings */
+#define H2_HEADER_TABLE_SIZE	0x1
+#define H2_ENABLE_PUSH		0x2
+#define H2_MAX_CONCURRENT	0x3
+#define H2_INITIAL_WINDOW	0x4
+#define H2_MAX_FRAME_SIZE	0x5
+
+/* error codes */
+#define H2_NO_ERROR		0x0
+#define H2_PROTOCOL_ERROR	0x1
+#define H2_FRAME_SIZE_ERROR	0x6
+#define H2_REFUSED_STREAM	0x7
+#define H2_CANCEL		0x8
+#define H2_COMPRESSION_ERROR	0x9
+#define H2_ENHANCE_YOUR_CALM	0xb
+
+/* the request headers we add to the server's table, newest first */
+#define HPACK_STATIC		61
+#define HPACK_OUR_ACCEPT	(HPACK_STATIC + 1)
+#define HPACK_OUR_AGENT		(HPACK_STATIC + 2)
+#define HPACK_OUR_AUTHORITY	(HPACK_STATIC + 3)
+
+struct h2_stream {
+	unsigned int id;
+	int status;
+	int done;
+	int failed;
+	int refused;	/* never started on, so safe to send again */
+	size_t unacked;
+	char *body;
+	size_t len;
+	size_t size;
+};
+
+struct hpack_entry {
+	char *name;
+	char *value;
+};
+
+struct h2_conn {
+	char *host;
+	unsigned short port;
+	int h1;		/* the server didn't offer h2 */
+	struct http_request *t;
+	int goaway;
+	unsigned int next_id;
+	unsigned int max_streams;
+	size_t max_frame;
+	size_t unacked;
+
+	/* what the server's decoder holds of ours */
+	size_t enc_max;
+	int enc_update;
+	int enc_indexed;
+
+	/* and ours of the server's */
+	struct hpack_entry dec[H2_TABLE_ENTRIES];
+	int dec_newest;
+	int dec_count;
+	size_t dec_size;
+	size_t dec_max;
+
+	/* a header block split across CONTINUATION frames */
+	unsigned char *block;
+	size_t block_len;
+	unsigned int block_stream;
+	int block_end;
+
+	struct h2_stream streams[H2_MAX_STREAMS];
+
+	unsigned char in[H2_FRAME_HEADER + H2_FRAME_MAX];
+	size_t in_len;
+};
+
+static struct h2_conn *conns[H2_MAX_CONNS];
+
+/* RFC 7541 appendix A */
+static const char *hpack_static[HPACK_STATIC + 1][2] = {
+	{ NULL, NULL },
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+/*
+ * RFC 7541 appendix B code lengths for each byte and EOS.  The code is
+ * canonical, so the codes themselves follow from these.
+ */
+static const unsigned char huff_len[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5,
+	5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10, 13, 6, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8,
+	13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6,
+	6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20,
+	22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24,
+	24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24, 22,
+	21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23, 21,
+	21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23, 26,
+	26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25, 19,
+	21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20,
+	24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26,
+	27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26, 30
+};
+static unsigned int huff_code[257];
+static unsigned short huff_sym[257];
+static unsigned int huff_first[31];
+static unsigned short huff_count[31];
+static unsigned short huff_off[31];
+static int huff_ready = 0;
+
+static void	huff_init(void);
+static char *	huff_decode(const unsigned char *src, size_t len);
+static size_t	huff_encode(const char *str, size_t len,
+		    unsigned char *dst);
+static size_t	hpack_put_int(unsigned char *dst, unsigned char first,
+		    int prefix, size_t val);
+static size_t	hpack_put_string(unsigned char *dst, const char *str);
+static int	hpack_get_int(const unsigned char **p,
+		    const unsigned char *end, int prefix, size_t *val);
+static char *	hpack_get_string(const unsigned char **p,
+		    const unsigned char *end);
+static int	hpack_lookup(struct h2_conn *c, size_t idx, const char **name,
+		    const char **value);
+static void	hpack_evict(struct h2_conn *c, size_t room);
+static void	hpack_insert(struct h2_conn *c, char *name, char *value);
+static int	hpack_decode(struct h2_conn *c, const unsigned char *p,
+		    size_t len, struct h2_stream *s);
+static struct h2_conn * h2_conn_new(struct url *url);
+static void	h2_conn_free(struct h2_conn *c);
+static int	h2_busy(struct h2_conn *c);
+static int	h2_poll(struct h2_conn *c);
+static int	h2_fill(struct h2_conn *c);
+static int	h2_process(struct h2_conn *c);
+static int	h2_frame(struct h2_conn *c, int type, int flags,
+		    unsigned int id, unsigned char *p, size_t len);
+static int	h2_headers(struct h2_conn *c, const unsigned char *p,
+		    size_t len);
+static void	h2_setting(struct h2_conn *c, unsigned int id,
+		    unsigned int val);
+static int	h2_write(struct h2_conn *c, int type, int flags,
+		    unsigned int id, const unsigned char *payload, size_t len);
+static int	h2_window(struct h2_conn *c, unsigned int id, size_t len);
+static int	h2_fail(struct h2_conn *c, unsigned int code,
+		    const char *why);
+static void	h2_drop(struct h2_conn *c);
+static struct h2_stream * h2_stream(struct h2_conn *c, unsigned int id);
+static void	h2_release(struct h2_stream *s);
+static void	put_frame_header(unsigned char *buf, size_t len, int type,
+		    int flags, unsigned int id);
+static void	put32(unsigned char *p, unsigned int val);
+static unsigned int get32(const unsigned char *p);
+
+/*
+ * Attach req to an open HTTP/2 connection to its host, making one if there
+ * isn't one.  Returns 0 if it was, 1 if the host only speaks HTTP/1 and req
+ * should be made the usual way, or -1 on failure.
+ */
+int
+h2_open(struct http_request *req)
+{
+	struct h2_conn *c;
+	int i, slot = -1;
+
+	for (i = 0; i < H2_MAX_CONNS; i++) {
+		c = conns[i];
+		if (c == NULL) {
+			if (slot == -1)
+				slot = i;
+			continue;
+		}
+		if (c->port != req->url->port ||
+		    strcmp(c->host, req->url->host) != 0) {
+			if (slot == -1 && !h2_busy(c))
+				slot = i;
+			continue;
+		}
+		if (c->h1)
+			return 1;
+		if (h2_poll(c)) {
+			req->h2 = c;
+			return 0;
+		}
+		/* gone away, but finish off anything still coming in on it */
+		if (!h2_busy(c)) {
+			h2_conn_free(c);
+			conns[i] = NULL;
+			if (slot == -1)
+				slot = i;
+		}
+	}
+
+	/* every connection is in use, so fall back to a separate one */
+	if (slot == -1)
+		return 1;
+
+	if (conns[slot] != NULL)
+		h2_conn_free(conns[slot]);
+	conns[slot] = c = h2_conn_new(req->url);
+	if (c == NULL)
+		return -1;
+	if (c->h1)
+		return 1;
+
+	req->h2 = c;
+	return 0;
+}
+
+/* send the GET for a request attached with h2_open() on a new stream */
+int
+h2_send(struct http_request *req)
+{
+	struct h2_conn *c = req->h2;
+	struct h2_stream *s = NULL;
+	unsigned char *block, *p;
+	size_t size, need, max;
+	unsigned int active = 0;
+	int i, indexed;
+
+	if (c->t == NULL || c->goaway) {
+		warnx("HTTP/2 connection to %s closed", c->host);
+		return -1;
+	}
+
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		if (c->streams[i].id == 0) {
+			if (s == NULL)
+				s = &c->streams[i];
+		} else if (!c->streams[i].done)
+			active++;
+	}
+	if (s == NULL || active >= c->max_streams) {
+		warnx("too many requests in flight to %s", c->host);
+		return -1;
+	}
+
+	size = H2_FRAME_HEADER + 64 + strlen(req->url->path) +
+	    strlen(c->host) + strlen(__progname);
+	block = malloc(size);
+	if (block == NULL)
+		err(1, "malloc");
+	p = block + H2_FRAME_HEADER;
+
+	/*
+	 * The table changes below only count once the server has them, so
+	 * they're not kept until the request has been sent
+	 */
+	max = (c->enc_max < H2_TABLE_SIZE ? c->enc_max : H2_TABLE_SIZE);
+	if (c->enc_update)
+		/* the server shrank its table, so say we've noticed */
+		p += hpack_put_int(p, 0x20, 5, max);
+	indexed = c->enc_indexed;
+
+	*p++ = 0x80 | 2;	/* :method GET */
+	*p++ = 0x80 | 7;	/* :scheme https */
+
+	/* the path changes every time and has our API key in it */
+	p += hpack_put_int(p, 0x10, 4, 4);
+	p += hpack_put_string(p, req->url->path);
+
+	if (indexed) {
+		*p++ = 0x80 | HPACK_OUR_AUTHORITY;
+		*p++ = 0x80 | HPACK_OUR_AGENT;
+		*p++ = 0x80 | HPACK_OUR_ACCEPT;
+	} else {
+		need = (32 + 10 + strlen(c->host)) +
+		    (32 + 10 + strlen(__progname)) + (32 + 6 + 3);
+		indexed = (need <= max);
+
+		p += hpack_put_int(p, indexed ? 0x40 : 0, indexed ? 6 : 4, 1);
+		p += hpack_put_string(p, c->host);
+		p += hpack_put_int(p, indexed ? 0x40 : 0, indexed ? 6 : 4, 58);
+		p += hpack_put_string(p, __progname);
+		p += hpack_put_int(p, indexed ? 0x40 : 0, indexed ? 6 : 4, 19);
+		p += hpack_put_string(p, "*/*");
+	}
+
+	size = p - block - H2_FRAME_HEADER;
+	if (size > c->max_frame) {
+		warnx("request to %s too large", c->host);
+		free(block);
+		return -1;
+	}
+
+	memset(s, 0, sizeof(struct h2_stream));
+	s->id = c->next_id;
+	c->next_id += 2;
+	if (c->next_id > 0x7fffffff)
+		/* out of stream ids, so use a new connection after this */
+		c->goaway = 1;
+
+	put_frame_header(block, size, H2_HEADERS,
+	    H2_END_STREAM | H2_END_HEADERS, s->id);
+
+#if DEBUG
+	printf("h2 >>> [%u] GET %s (%zu byte header block)\n", s->id,
+	    req->url->path, size);
+#endif
+
+	if (http_req_write(c->t, (char *)block, H2_FRAME_HEADER + size) !=
+	    H2_FRAME_HEADER + size) {
+		free(block);
+		memset(s, 0, sizeof(struct h2_stream));
+		warnx("failed sending request to %s", c->host);
+		h2_drop(c);
+		return -1;
+	}
+	free(block);
+
+	c->enc_update = 0;
+	c->enc_indexed = indexed;
+
+	req->stream = s->id;
+	return 0;
+}
+
+/* whether a request attached with h2_open() can still be sent */
+int
+h2_alive(struct http_request *req)
+{
+	return h2_poll(req->h2);
+}
+
+/*
+ * Wait for a sent request's response, handling frames for any others on the
+ * connection as they arrive, and turn req into one that reads it back
+ */
+struct http_request *
+h2_response(struct http_request *req)
+{
+	struct h2_conn *c = req->h2;
+	struct h2_stream *s;
+	size_t len;
+	char *buf;
+	int retried = 0;
+
+	for (;;) {
+		s = h2_stream(c, req->stream);
+		if (s == NULL) {
+			http_req_free(req);
+			return NULL;
+		}
+
+		while (!s->done) {
+			if (h2_fill(c) != 0)
+				break;
+			h2_process(c);
+		}
+
+		if (!s->refused || retried)
+			break;
+
+		/* the server went away before starting on it, so ask again */
+		h2_release(s);
+		req->h2 = NULL;
+		req->stream = 0;
+		retried = 1;
+		if (h2_open(req) != 0 || h2_send(req) != 0) {
+			http_req_free(req);
+			return NULL;
+		}
+		c = req->h2;
+	}
+
+	req->h2 = NULL;
+	req->stream = 0;
+
+	if (s->failed || s->refused || s->status == 0) {
+		warnx("no response from %s over HTTP/2", c->host);
+		h2_release(s);
+		http_req_free(req);
+		return NULL;
+	}
+
+	/* dress it up for http_req_skip_header() */
+	len = snprintf(NULL, 0, "HTTP/2.0 %d\r\n\r\n", s->status);
+	buf = malloc(len + s->len + 1);
+	if (buf == NULL)
+		err(1, "malloc");
+	snprintf(buf, len + 1, "HTTP/2.0 %d\r\n\r\n", s->status);
+	if (s->len)
+		memcpy(buf + len, s->body, s->len);
+	buf[len + s->len] = '\0';
+
+	req->buf = buf;
+	req->buf_len = len + s->len;
+	req->buf_off = 0;
+
+	h2_release(s);
+
+	return req;
+}
+
+/* forget about a request, telling the server to stop if it's still going */
+void
+h2_cancel(struct http_request *req)
+{
+	struct h2_conn *c = req->h2;
+	struct h2_stream *s;
+	unsigned char code[4];
+
+	req->h2 = NULL;
+	if ((s = h2_stream(c, req->stream)) == NULL)
+		return;
+	req->stream = 0;
+
+	if (!s->done && c->t != NULL) {
+		put32(code, H2_CANCEL);
+		h2_write(c, H2_RST_STREAM, 0, s->id, code, sizeof(code));
+	}
+	h2_release(s);
+}
+
+static struct h2_conn *
+h2_conn_new(struct url *url)
+{
+	struct h2_conn *c;
+	unsigned char hello[sizeof(H2_PREFACE) - 1 +
+	    H2_FRAME_HEADER + 12 + H2_FRAME_HEADER + 4], *p;
+#if TLS
+	const char *alpn;
+	char *surl;
+#endif
+
+	c = malloc(sizeof(struct h2_conn));
+	if (c == NULL)
+		err(1, "malloc");
+	memset(c, 0, sizeof(struct h2_conn));
+	c->host = strdup(url->host);
+	if (c->host == NULL)
+		err(1, "strdup");
+	c->port = url->port;
+
+#if TLS
+	if (asprintf(&surl, "https://%s:%u/", url->host, url->port) == -1)
+		err(1, "asprintf");
+	c->t = http_connect_alpn(surl, "h2,http/1.1");
+	free(surl);
+	if (c->t == NULL) {
+		h2_conn_free(c);
+		return NULL;
+	}
+	alpn = tls_conn_alpn_selected(c->t->tls);
+	if (alpn == NULL || strcmp(alpn, "h2") != 0) {
+#if DEBUG
+		printf("%s doesn't speak HTTP/2\n", c->host);
+#endif
+		http_req_free(c->t);
+		c->t = NULL;
+		c->h1 = 1;
+		return c;
+	}
+#else
+	/* only offered through ALPN */
+	c->h1 = 1;
+	return c;
+#endif
+
+#if DEBUG
+	printf("using HTTP/2 to %s\n", c->host);
+#endif
+
+	c->next_id = 1;
+	c->max_streams = H2_MAX_STREAMS;
+	c->max_frame = H2_FRAME_MAX;
+	c->enc_max = H2_TABLE_SIZE;
+	c->dec_max = H2_TABLE_SIZE;
+	c->dec_newest = H2_TABLE_ENTRIES - 1;
+
+	/* no pushes, and big enough windows that we never wait on them */
+	p = hello;
+	memcpy(p, H2_PREFACE, sizeof(H2_PREFACE) - 1);
+	p += sizeof(H2_PREFACE) - 1;
+	put_frame_header(p, 12, H2_SETTINGS, 0, 0);
+	p += H2_FRAME_HEADER;
+	p[0] = 0;
+	p[1] = H2_ENABLE_PUSH;
+	put32(p + 2, 0);
+	p[6] = 0;
+	p[7] = H2_INITIAL_WINDOW;
+	put32(p + 8, H2_WINDOW);
+	p += 12;
+	put_frame_header(p, 4, H2_WINDOW_UPDATE, 0, 0);
+	p += H2_FRAME_HEADER;
+	put32(p, H2_WINDOW - 65535);
+	p += 4;
+
+	if (http_req_write(c->t, (char *)hello, p - hello) != p - hello) {
+		warnx("failed starting HTTP/2 with %s", c->host);
+		h2_conn_free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+static void
+h2_conn_free(struct h2_conn *c)
+{
+	int i;
+
+	h2_drop(c);
+	for (i = 0; i < H2_MAX_STREAMS; i++)
+		h2_release(&c->streams[i]);
+	for (i = 0; i < H2_TABLE_ENTRIES; i++) {
+		free(c->dec[i].name);
+		free(c->dec[i].value);
+	}
+	free(c->host);
+	free(c);
+}
+
+/* whether any stream on c is still waiting on or holding a response */
+static int
+h2_busy(struct h2_conn *c)
+{
+	int i;
+
+	for (i = 0; i < H2_MAX_STREAMS; i++)
+		if (c->streams[i].id != 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Deal with anything the server sent while we weren't reading, like a PING
+ * or a GOAWAY after sitting idle, and return whether c can take requests
+ */
+static int
+h2_poll(struct h2_conn *c)
+{
+	struct pollfd pfd;
+
+	while (c->t != NULL) {
+		pfd.fd = c->t->socket;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0)
+			break;
+		if (h2_fill(c) != 0)
+			break;
+		h2_process(c);
+	}
+
+	return (c->t != NULL && !c->goaway);
+}
+
+/* read whatever is available, up to the end of a frame */
+static int
+h2_fill(struct h2_conn *c)
+{
+	ssize_t ret;
+
+	if (c->t == NULL)
+		return -1;
+
+	ret = http_req_read(c->t, (char *)c->in + c->in_len,
+	    sizeof(c->in) - c->in_len);
+	if (ret <= 0) {
+		h2_drop(c);
+		return -1;
+	}
+	c->in_len += ret;
+
+	return 0;
+}
+
+/* handle every complete frame that has been read */
+static int
+h2_process(struct h2_conn *c)
+{
+	size_t len, off = 0;
+
+	while (c->t != NULL && c->in_len - off >= H2_FRAME_HEADER) {
+		len = (c->in[off] << 16) | (c->in[off + 1] << 8) |
+		    c->in[off + 2];
+		if (len > H2_FRAME_MAX)
+			return h2_fail(c, H2_FRAME_SIZE_ERROR,
+			    "oversized frame");
+		if (c->in_len - off < H2_FRAME_HEADER + len)
+			break;
+
+		if (h2_frame(c, c->in[off + 3], c->in[off + 4],
+		    get32(c->in + off + 5) & 0x7fffffff,
+		    c->in + off + H2_FRAME_HEADER, len) != 0)
+			return -1;
+		off += H2_FRAME_HEADER + len;
+	}
+
+	if (c->t == NULL)
+		return -1;
+
+	c->in_len -= off;
+	memmove(c->in, c->in + off, c->in_len);
+
+	return 0;
+}
+
+static int
+h2_frame(struct h2_conn *c, int type, int flags, unsigned int id,
+    unsigned char *p, size_t len)
+{
+	struct h2_stream *s;
+	unsigned char *block, code[4];
+	size_t flen = len, i;
+	unsigned int last;
+	int ret;
+
+	if (c->block != NULL && (type != H2_CONTINUATION ||
+	    id != c->block_stream))
+		return h2_fail(c, H2_PROTOCOL_ERROR,
+		    "header block interrupted");
+
+	if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_PADDED)) {
+		if (len < 1 || p[0] >= len)
+			return h2_fail(c, H2_PROTOCOL_ERROR, "bad padding");
+		len -= 1 + p[0];
+		p++;
+	}
+
+	switch (type) {
+	case H2_DATA:
+		/* padding counts against the window too */
+		c->unacked += flen;
+		if (c->unacked >= H2_WINDOW / 2) {
+			if (h2_window(c, 0, c->unacked) != 0)
+				return -1;
+			c->unacked = 0;
+		}
+
+		s = h2_stream(c, id);
+		if (s == NULL || s->done)
+			/* cancelled */
+			return 0;
+
+		if (s->len + len > H2_MAX_BODY) {
+			warnx("response from %s too large", c->host);
+			put32(code, H2_CANCEL);
+			h2_write(c, H2_RST_STREAM, 0, s->id, code,
+			    sizeof(code));
+			s->failed = s->done = 1;
+			return 0;
+		}
+		if (s->len + len > s->size) {
+			s->size = (s->len + len) * 2;
+			s->body = realloc(s->body, s->size);
+			if (s->body == NULL)
+				err(1, "realloc");
+		}
+		memcpy(s->body + s->len, p, len);
+		s->len += len;
+
+		if (flags & H2_END_STREAM)
+			s->done = 1;
+		else {
+			s->unacked += flen;
+			if (s->unacked >= H2_WINDOW / 2) {
+				if (h2_window(c, id, s->unacked) != 0)
+					return -1;
+				s->unacked = 0;
+			}
+		}
+		return 0;
+
+	case H2_HEADERS:
+		if (flags & H2_PRIORITY) {
+			if (len < 5)
+				return h2_fail(c, H2_PROTOCOL_ERROR,
+				    "short HEADERS");
+			p += 5;
+			len -= 5;
+		}
+		c->block_stream = id;
+		c->block_end = (flags & H2_END_STREAM);
+		if (flags & H2_END_HEADERS)
+			return h2_headers(c, p, len);
+
+		c->block = malloc(len ? len : 1);
+		if (c->block == NULL)
+			err(1, "malloc");
+		memcpy(c->block, p, len);
+		c->block_len = len;
+		return 0;
+
+	case H2_CONTINUATION:
+		if (c->block == NULL)
+			return h2_fail(c, H2_PROTOCOL_ERROR,
+			    "stray CONTINUATION");
+		if (c->block_len + len > H2_MAX_BODY)
+			return h2_fail(c, H2_ENHANCE_YOUR_CALM,
+			    "header block too large");
+		block = realloc(c->block, c->block_len + len + 1);
+		if (block == NULL)
+			err(1, "realloc");
+		memcpy(block + c->block_len, p, len);
+		c->block = block;
+		c->block_len += len;
+		if (!(flags & H2_END_HEADERS))
+			return 0;
+
+		c->block = NULL;
+		ret = h2_headers(c, block, c->block_len);
+		free(block);
+		return ret;
+
+	case H2_RST_STREAM:
+		if (len != 4)
+			return h2_fail(c, H2_FRAME_SIZE_ERROR,
+			    "bad RST_STREAM");
+		if ((s = h2_stream(c, id)) != NULL && !s->done) {
+			s->done = 1;
+			if (get32(p) == H2_REFUSED_STREAM)
+				s->refused = 1;
+			else
+				s->failed = 1;
+		}
+		return 0;
+
+	case H2_SETTINGS:
+		if (flags & H2_ACK)
+			return 0;
+		if (len % 6 != 0)
+			return h2_fail(c, H2_FRAME_SIZE_ERROR, "bad SETTINGS");
+		for (i = 0; i < len; i += 6)
+			h2_setting(c, (p[i] << 8) | p[i + 1], get32(p + i + 2));
+		return h2_write(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+
+	case H2_PING:
+		if (len != 8)
+			return h2_fail(c, H2_FRAME_SIZE_ERROR, "bad PING");
+		if (flags & H2_ACK)
+			return 0;
+		return h2_write(c, H2_PING, H2_ACK, 0, p, 8);
+
+	case H2_GOAWAY:
+		if (len < 8)
+			return h2_fail(c, H2_FRAME_SIZE_ERROR, "bad GOAWAY");
+		last = get32(p) & 0x7fffffff;
+#if DEBUG
+		printf("%s going away after stream %u (error %u)\n", c->host,
+		    last, get32(p + 4));
+#endif
+		c->goaway = 1;
+		for (i = 0; i < H2_MAX_STREAMS; i++) {
+			s = &c->streams[i];
+			if (s->id > last && !s->done)
+				s->refused = s->done = 1;
+		}
+		return 0;
+
+	case H2_PUSH_PROMISE:
+		return h2_fail(c, H2_PROTOCOL_ERROR, "push when disabled");
+
+	default:
+		/* PRIORITY, WINDOW_UPDATE since we only send headers, etc. */
+		return 0;
+	}
+}
+
+/* a complete header block for the stream it was started on */
+static int
+h2_headers(struct h2_conn *c, const unsigned char *p, size_t len)
+{
+	struct h2_stream *s;
+
+	s = h2_stream(c, c->block_stream);
+	if (s != NULL && s->done)
+		s = NULL;
+
+	/* decoded even if cancelled, to keep the table in step */
+	if (hpack_decode(c, p, len, s) != 0)
+		return h2_fail(c, H2_COMPRESSION_ERROR, "bad header block");
+
+	if (s != NULL && c->block_end)
+		s->done = 1;
+
+	return 0;
+}
+
+static void
+h2_setting(struct h2_conn *c, unsigned int id, unsigned int val)
+{
+	switch (id) {
+	case H2_HEADER_TABLE_SIZE:
+		if (val == c->enc_max)
+			break;
+		/* put ours back in if it was shrunk, once we've said so */
+		c->enc_max = val;
+		c->enc_update = 1;
+		c->enc_indexed = 0;
+		break;
+	case H2_MAX_CONCURRENT:
+		c->max_streams = val;
+		break;
+	case H2_MAX_FRAME_SIZE:
+		c->max_frame = val;
+		break;
+	}
+}
+
+static int
+h2_write(struct h2_conn *c, int type, int flags, unsigned int id,
+    const unsigned char *payload, size_t len)
+{
+	unsigned char frame[H2_FRAME_HEADER + 8];
+
+	if (c->t == NULL)
+		return -1;
+	if (len > sizeof(frame) - H2_FRAME_HEADER)
+		errx(1, "h2_write overflow");
+
+	put_frame_header(frame, len, type, flags, id);
+	if (len)
+		memcpy(frame + H2_FRAME_HEADER, payload, len);
+
+	if (http_req_write(c->t, (char *)frame, H2_FRAME_HEADER + len) !=
+	    H2_FRAME_HEADER + len) {
+		warnx("failed writing to %s", c->host);
+		h2_drop(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* let the server send len more bytes on stream id, or the connection */
+static int
+h2_window(struct h2_conn *c, unsigned int id, size_t len)
+{
+	unsigned char inc[4];
+
+	put32(inc, len);
+	return h2_write(c, H2_WINDOW_UPDATE, 0, id, inc, sizeof(inc));
+}
+
+/* give up on a connection the server has broken protocol on */
+static int
+h2_fail(struct h2_conn *c, unsigned int code, const char *why)
+{
+	unsigned char payload[8];
+
+	warnx("HTTP/2 error from %s: %s", c->host, why);
+
+	put32(payload, 0);
+	put32(payload + 4, code);
+	h2_write(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+	h2_drop(c);
+
+	return -1;
+}
+
+/* close c, failing anything still waiting on it */
+static void
+h2_drop(struct h2_conn *c)
+{
+	int i;
+
+	if (c->t != NULL) {
+		http_req_free(c->t);
+		c->t = NULL;
+	}
+	c->in_len = 0;
+	free(c->block);
+	c->block = NULL;
+
+	for (i = 0; i < H2_MAX_STREAMS; i++) {
+		if (c->streams[i].id != 0 && !c->streams[i].done)
+			c->streams[i].failed = c->streams[i].done = 1;
+	}
+}
+
+static struct h2_stream *
+h2_stream(struct h2_conn *c, unsigned int id)
+{
+	int i;
+
+	if (c == NULL || id == 0)
+		return NULL;
+
+	for (i = 0; i < H2_MAX_STREAMS; i++)
+		if (c->streams[i].id == id)
+			return &c->streams[i];
+
+	return NULL;
+}
+
+static void
+h2_release(struct h2_stream *s)
+{
+	free(s->body);
+	memset(s, 0, sizeof(struct h2_stream));
+}
+
+static int
+hpack_decode(struct h2_conn *c, const unsigned char *p, size_t len,
+    struct h2_stream *s)
+{
+	const unsigned char *end = p + len;
+	const char *name, *value;
+	char *nname, *nvalue;
+	size_t idx;
+	int indexed;
+
+	while (p < end) {
+		nname = nvalue = NULL;
+		indexed = 0;
+
+		if (*p & 0x80) {
+			/* indexed */
+			if (hpack_get_int(&p, end, 7, &idx) != 0 ||
+			    hpack_lookup(c, idx, &name, &value) != 0)
+				return -1;
+		} else if ((*p & 0xe0) == 0x20) {
+			/* dynamic table size update */
+			if (hpack_get_int(&p, end, 5, &idx) != 0 ||
+			    idx > H2_TABLE_SIZE)
+				return -1;
+			c->dec_max = idx;
+			hpack_evict(c, 0);
+			continue;
+		} else {
+			/*
+			 * Literal, either added to the table (01), or not
+			 * (0000), or never to be (0001)
+			 */
+			indexed = ((*p & 0xc0) == 0x40);
+			if (hpack_get_int(&p, end, indexed ? 6 : 4, &idx) != 0)
+				return -1;
+			if (idx == 0) {
+				if ((nname = hpack_get_string(&p, end)) == NULL)
+					return -1;
+			} else {
+				if (hpack_lookup(c, idx, &name, &value) != 0)
+					return -1;
+				if ((nname = strdup(name)) == NULL)
+					err(1, "strdup");
+			}
+			if ((nvalue = hpack_get_string(&p, end)) == NULL) {
+				free(nname);
+				return -1;
+			}
+			name = nname;
+			value = nvalue;
+		}
+
+#if DEBUG
+		printf("h2 <<< [%u] %s: %s\n", s ? s->id : 0, name, value);
+#endif
+		if (s != NULL && strcmp(name, ":status") == 0)
+			s->status = atoi(value);
+
+		if (indexed)
+			hpack_insert(c, nname, nvalue);
+		else {
+			free(nname);
+			free(nvalue);
+		}
+	}
+
+	return 0;
+}
+
+static int
+hpack_lookup(struct h2_conn *c, size_t idx, const char **name,
+    const char **value)
+{
+	struct hpack_entry *e;
+
+	if (idx == 0)
+		return -1;
+
+	if (idx <= HPACK_STATIC) {
+		*name = hpack_static[idx][0];
+		*value = hpack_static[idx][1];
+		return 0;
+	}
+
+	idx -= HPACK_STATIC + 1;
+	if (idx >= c->dec_count)
+		return -1;
+
+	e = &c->dec[(c->dec_newest - (int)idx + H2_TABLE_ENTRIES) %
+	    H2_TABLE_ENTRIES];
+	*name = e->name;
+	*value = e->value;
+	return 0;
+}
+
+/* drop the oldest entries until there is room for room more bytes */
+static void
+hpack_evict(struct h2_conn *c, size_t room)
+{
+	struct hpack_entry *e;
+
+	while (c->dec_count > 0 && c->dec_size + room > c->dec_max) {
+		e = &c->dec[(c->dec_newest - c->dec_count + 1 +
+		    H2_TABLE_ENTRIES) % H2_TABLE_ENTRIES];
+		c->dec_size -= strlen(e->name) + strlen(e->value) + 32;
+		free(e->name);
+		free(e->value);
+		e->name = e->value = NULL;
+		c->dec_count--;
+	}
+}
+
+static void
+hpack_insert(struct h2_conn *c, char *name, char *value)
+{
+	struct hpack_entry *e;
+	size_t size;
+
+	size = strlen(name) + strlen(value) + 32;
+	hpack_evict(c, size);
+	if (size > c->dec_max) {
+		/* which leaves the table empty */
+		free(name);
+		free(value);
+		return;
+	}
+
+	c->dec_newest = (c->dec_newest + 1) % H2_TABLE_ENTRIES;
+	e = &c->dec[c->dec_newest];
+	e->name = name;
+	e->value = value;
+	c->dec_count++;
+	c->dec_size += size;
+}
+
+static int
+hpack_get_int(const unsigned char **p, const unsigned char *end, int prefix,
+    size_t *val)
+{
+	size_t max = (1 << prefix) - 1;
+	int shift = 0;
+
+	if (*p >= end)
+		return -1;
+
+	*val = *(*p)++ & max;
+	if (*val < max)
+		return 0;
+
+	do {
+		if (*p >= end || shift > 28)
+			return -1;
+		*val += (size_t)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+
+	return 0;
+}
+
+static char *
+hpack_get_string(const unsigned char **p, const unsigned char *end)
+{
+	size_t len;
+	char *str;
+	int huff;
+
+	if (*p >= end)
+		return NULL;
+
+	huff = (**p & 0x80);
+	if (hpack_get_int(p, end, 7, &len) != 0 || len > end - *p)
+		return NULL;
+
+	if (huff)
+		str = huff_decode(*p, len);
+	else {
+		str = malloc(len + 1);
+		if (str == NULL)
+			err(1, "malloc");
+		memcpy(str, *p, len);
+		str[len] = '\0';
+	}
+	*p += len;
+
+	return str;
+}
+
+static size_t
+hpack_put_int(unsigned char *dst, unsigned char first, int prefix,
+    size_t val)
+{
+	size_t max = (1 << prefix) - 1, n = 0;
+
+	if (val < max) {
+		dst[n++] = first | val;
+		return n;
+	}
+
+	dst[n++] = first | max;
+	val -= max;
+	while (val >= 0x80) {
+		dst[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	dst[n++] = val;
+
+	return n;
+}
+
+/* a string literal, Huffman coded if that makes it any shorter */
+static size_t
+hpack_put_string(unsigned char *dst, const char *str)
+{
+	size_t len, hlen = 0, n, i;
+
+	if (!huff_ready)
+		huff_init();
+
+	len = strlen(str);
+	for (i = 0; i < len; i++)
+		hlen += huff_len[(unsigned char)str[i]];
+	hlen = (hlen + 7) / 8;
+
+	if (hlen < len) {
+		n = hpack_put_int(dst, 0x80, 7, hlen);
+		return n + huff_encode(str, len, dst + n);
+	}
+
+	n = hpack_put_int(dst, 0, 7, len);
+	memcpy(dst + n, str, len);
+	return n + len;
+}
+
+static void
+huff_init(void)
+{
+	unsigned int code = 0;
+	int l, sym, n = 0;
+
+	memset(huff_count, 0, sizeof(huff_count));
+	for (sym = 0; sym < 257; sym++)
+		huff_count[huff_len[sym]]++;
+
+	/* codes of each length are consecutive, in symbol order */
+	for (l = 1; l <= 30; l++) {
+		huff_first[l] = code;
+		huff_off[l] = n;
+		for (sym = 0; sym < 257; sym++) {
+			if (huff_len[sym] != l)
+				continue;
+			huff_code[sym] = code++;
+			huff_sym[n++] = sym;
+		}
+		code <<= 1;
+	}
+
+	huff_ready = 1;
+}
+
+static char *
+huff_decode(const unsigned char *src, size_t len)
+{
+	unsigned int code = 0, sym;
+	size_t i, n = 0;
+	char *out;
+	int b, l = 0;
+
+	if (!huff_ready)
+		huff_init();
+
+	/* the shortest code is 5 bits */
+	out = malloc((len * 8 / 5) + 1);
+	if (out == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			code = (code << 1) | ((src[i] >> b) & 1);
+			l++;
+			if (code - huff_first[l] < huff_count[l]) {
+				sym = huff_sym[huff_off[l] + code -
+				    huff_first[l]];
+				if (sym == 256)
+					goto bad;
+				out[n++] = sym;
+				code = 0;
+				l = 0;
+			} else if (l == 30)
+				goto bad;
+		}
+	}
+
+	/* anything left over must be padding, a prefix of EOS */
+	if (l > 7 || code != (1U << l) - 1)
+		goto bad;
+
+	out[n] = '\0';
+	return out;
+
+bad:
+	free(out);
+	return NULL;
+}
+
+static size_t
+huff_encode(const char *str, size_t len, unsigned char *dst)
+{
+	uint64_t acc = 0;
+	size_t i, n = 0;
+	int bits = 0, c;
+
+	for (i = 0; i < len; i++) {
+		c = (unsigned char)str[i];
+		acc = (acc << huff_len[c]) | huff_code[c];
+		bits += huff_len[c];
+		while (bits >= 8) {
+			bits -= 8;
+			dst[n++] = acc >> bits;
+		}
+	}
+
+	/* pad with the start of EOS, which is all ones */
+	if (bits)
+		dst[n++] = (acc << (8 - bits)) | (0xff >> bits);
+
+	return n;
+}
+
+static void
+put_frame_header(unsigned char *buf, size_t len, int type, int flags,
+    unsigned int id)
+{
+	buf[0] = (len >> 16) & 0xff;
+	buf[1] = (len >> 8) & 0xff;
+	buf[2] = len & 0xff;
+	buf[3] = type;
+	buf[4] = flags;
+	put32(buf + 5, id & 0x7fffffff);
+}
+
+static void
+put32(unsigned char *p, unsigned int val)
+{
+	p[0] = (val >> 24) & 0xff;
+	p[1] = (val >> 16) & 0xff;
+	p[2] = (val >> 8) & 0xff;
+	p[3] = val & 0xff;
+}
+
+static unsigned int
+get32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H2_H__
+#define __H2_H__
+
+#include "http.h"
+
+/* hosts to keep an HTTP/2 connection open to */
+#define H2_MAX_CONNS		4
+/* requests that can be in flight on one connection */
+#define H2_MAX_STREAMS		64
+/* largest response body accepted on a stream */
+#define H2_MAX_BODY		(1024 * 1024)
+/* receive window advertised for the connection and for each stream */
+#define H2_WINDOW		(1024 * 1024)
+/* largest frame we accept, which is the smallest a server may send */
+#define H2_FRAME_MAX		16384
+/* decoder dynamic table size, the default, which we never change */
+#define H2_TABLE_SIZE		4096
+/* entries that fit in it, at 32 bytes of overhead each */
+#define H2_TABLE_ENTRIES	(H2_TABLE_SIZE / 32)
+
+int h2_open(struct http_request *req);
+int h2_send(struct http_request *req);
+int h2_alive(struct http_request *req);
+struct http_request * h2_response(struct http_request *req);
+void h2_cancel(struct http_request *req);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "history.h"
+
+/* the last HISTORY_MAX observations, oldest overwritten first */
+static struct observation ring[HISTORY_MAX];
+static int head = 0;
+static int count = 0;
+
+void
+history_add(const struct observation *obs)
+{
+	memcpy(&ring[head], obs, sizeof(struct observation));
+	head = (head + 1) % HISTORY_MAX;
+	if (count < HISTORY_MAX)
+		count++;
+}
+
+int
+history_count(void)
+{
+	return count;
+}
+
+/* 0 is the newest */
+const struct observation *
+history_get(int age)
+{
+	if (age < 0 || age >= count)
+		return NULL;
+
+	return &ring[(head - 1 - age + HISTORY_MAX) % HISTORY_MAX];
+}
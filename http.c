@@ -14,16 +14,84 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#if KTLS
+#include <linux/tls.h>
+#endif
 #include "http.h"
+#include "h2.h"
+#if URING
+#include "uring.h"
+#endif
+#include "alloc.h"
 
 extern char *__progname;
 
+static int hedge_percentile = 0;
+static int ttfb[HTTP_TTFB_SAMPLES];
+static int nttfb = 0;
+static int use_h2 = 0;
+static int use_uring = 0;
+static int tls_modern = 0;
+
+/* TLS handshakes so far, and how long they took */
+static int handshakes = 0;
+static int resumed = 0;
+static long long handshake_us = 0;
+
+/* how long finished requests spent resolving, connecting, etc. */
+static int ntimed = 0, ndeferred = 0;
+static long long resolve_us = 0, connect_us = 0, secure_us = 0,
+    first_us = 0;
+
+#if TLS
+/* files libtls keeps each host's session in, to resume it next time */
+static struct {
+	char *host;
+	FILE *file;
+} sessions[HTTP_MAX_SESSIONS];
+#endif
+static int fetch_concurrency = HTTP_FETCH_CONCURRENCY;
+
+/* requests sent ahead with http_start() that nobody has asked for yet */
+static struct {
+	char *url;
+	struct http_request *req;
+} started[HTTP_MAX_STARTED];
+
+static void	url_unescape(char *str);
+static int	http_address(struct http_request *req,
+		    struct sockaddr_storage *addr, socklen_t *addrlen, char *where,
+		    size_t wlen);
+static size_t	http_message(struct http_request *req);
+static int	http_deferred(int fd);
+static void	http_fetch_poll(struct http_fetch *fetches, int n);
+static int	http_req_probe(struct http_request *req);
+#if TLS
+static int	http_tls_session(const char *host);
+#endif
+#if KTLS
+static int	http_ktls(struct http_request *req);
+static ssize_t	http_ktls_read(struct http_request *req, char *data, size_t len,
+		    int flags);
+#endif
+static int	http_wait_first(struct http_request **reqs, int n, int ms);
+static int	http_hedge_ms(void);
+static int	ttfb_cmp(const void *a, const void *b);
+static long long http_us(const struct timespec *from,
+		    const struct timespec *to);
+
 struct url *
 url_parse(const char *str)
 {
@@ -33,16 +101,13 @@ url_parse(const char *str)
 	int ret, pos;
 	size_t len, schemelen, hostlen, pathlen;
 
+	/* one scratch allocation carved up for all three components */
 	len = strlen(str);
-	scheme = malloc(len + 1);
+	scheme = malloc((len + 1) * 3);
 	if (scheme == NULL)
 		err(1, "malloc");
-	host = malloc(len + 1);
-	if (host == NULL)
-		err(1, "malloc");
-	path = malloc(len + 1);
-	if (path == NULL)
-		err(1, "malloc");
+	host = scheme + len + 1;
+	path = host + len + 1;
 
 	/* scheme://host:port/path */
 	ret = sscanf(str, "%[^:]://%[^:]:%u%s%n", scheme, host, &port, path,
@@ -62,7 +127,11 @@ url_parse(const char *str)
 			port = 80;
 		else if (strcmp(scheme, "https") == 0)
 			port = 443;
-		else
+		else if (strcmp(scheme, "http+unix") == 0) {
+			/* http+unix://%2Fvar%2Frun%2Fsocket/path */
+			url_unescape(host);
+			port = 0;
+		} else
 			goto cleanup;
 		goto consolidate;
 	}
@@ -96,12 +165,29 @@ consolidate:
 
 cleanup:
 	free(scheme);
-	free(host);
-	free(path);
 
 	return url;
 }
 
+/* decode %xx escapes in place */
+static void
+url_unescape(char *str)
+{
+	char *out = str, hex[3] = { 0 };
+
+	for (; *str != '\0'; str++) {
+		if (str[0] == '%' && isxdigit((unsigned char)str[1]) &&
+		    isxdigit((unsigned char)str[2])) {
+			hex[0] = str[1];
+			hex[1] = str[2];
+			*out++ = strtol(hex, NULL, 16);
+			str += 2;
+		} else
+			*out++ = *str;
+	}
+	*out = '\0';
+}
+
 char *
 url_encode(unsigned char *str)
 {
@@ -139,16 +225,428 @@ encode:
 
 struct http_request *
 http_get(const char *surl)
+{
+	struct http_request *req;
+	int i;
+
+	for (i = 0; i < HTTP_MAX_STARTED; i++) {
+		if (started[i].url == NULL || strcmp(started[i].url, surl) != 0)
+			continue;
+		req = started[i].req;
+		free(started[i].url);
+		started[i].url = NULL;
+		started[i].req = NULL;
+		return http_hedge(req, surl);
+	}
+
+	req = http_connect(surl);
+	if (req == NULL)
+		return NULL;
+
+	if (http_send(req) != 0) {
+		http_req_free(req);
+		return NULL;
+	}
+
+	return http_hedge(req, surl);
+}
+
+/*
+ * Send a GET for url now without waiting for the response, which a later
+ * http_get() of the same url picks up.  Over HTTP/2, requests started
+ * together are in flight together on the one connection.
+ */
+int
+http_start(const char *surl)
+{
+	struct http_request *req;
+	int i;
+
+	for (i = 0; i < HTTP_MAX_STARTED; i++)
+		if (started[i].url == NULL)
+			break;
+	if (i == HTTP_MAX_STARTED)
+		return -1;
+
+	req = http_connect(surl);
+	if (req == NULL)
+		return -1;
+	if (http_send(req) != 0) {
+		http_req_free(req);
+		return -1;
+	}
+
+	started[i].url = strdup(surl);
+	if (started[i].url == NULL)
+		err(1, "strdup");
+	started[i].req = req;
+
+	return 0;
+}
+
+/* make HTTPS requests over HTTP/2 to servers that offer it */
+void
+http_h2(int enable)
+{
+	use_h2 = enable;
+}
+
+/*
+ * Choose how http_fetch_all() does its I/O, "poll" for non-blocking sockets
+ * waited on together or "uring" for io_uring on Linux when built with URING,
+ * and how many requests it keeps in flight at once
+ */
+int
+http_fetch_backend(const char *name, int concurrency)
+{
+	if (concurrency < 1)
+		return -1;
+
+	if (strcmp(name, "poll") == 0)
+		use_uring = 0;
+#if URING
+	else if (strcmp(name, "uring") == 0)
+		use_uring = 1;
+#endif
+	else
+		return -1;
+
+	fetch_concurrency = concurrency;
+	return 0;
+}
+
+/*
+ * Fetch all of urls at once rather than one after another, reading each
+ * response (headers and body, of at most max bytes) into memory.  Each of
+ * reqs is set to a request that reads its response back like one returned by
+ * http_get(), or NULL if it failed.  Returns how many failed.
+ */
+int
+http_fetch_all(const char **urls, int n, struct http_request **reqs,
+    size_t max)
+{
+	struct http_fetch *fetches, *f, *last = NULL;
+	struct http_request *req;
+	char where[NI_MAXHOST + 32];
+	int i, failed = 0;
+
+	fetches = calloc(n, sizeof(struct http_fetch));
+	if (fetches == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; i++) {
+		f = &fetches[i];
+		f->max = max;
+
+		req = malloc(sizeof(struct http_request));
+		if (req == NULL)
+			err(1, "malloc");
+		memset(req, 0, sizeof(struct http_request));
+		if ((req->url = url_parse(urls[i])) == NULL) {
+			free(req);
+			f->state = HTTP_FETCH_FAILED;
+			continue;
+		}
+		f->req = req;
+
+		/* TLS does its own I/O, so those go the usual way */
+		if (strcmp(req->url->scheme, "https") == 0) {
+			f->state = HTTP_FETCH_TLS;
+			continue;
+		}
+
+		/* a batch is usually all for the same server */
+		if (last != NULL && last->req->url->port == req->url->port &&
+		    strcmp(last->req->url->host, req->url->host) == 0) {
+			memcpy(&f->addr, &last->addr, sizeof(f->addr));
+			f->addrlen = last->addrlen;
+		} else if (http_address(req, &f->addr, &f->addrlen, where,
+		    sizeof(where)) != 0) {
+			f->state = HTTP_FETCH_FAILED;
+			continue;
+		}
+		last = f;
+
+		f->len = http_message(req);
+	}
+
+#if URING
+	if (!use_uring || uring_fetch(fetches, n, fetch_concurrency) != 0)
+#endif
+		http_fetch_poll(fetches, n);
+
+	for (i = 0; i < n; i++) {
+		f = &fetches[i];
+		reqs[i] = NULL;
+		if (f->state == HTTP_FETCH_DONE)
+			reqs[i] = f->req;
+		else {
+			http_req_free(f->req);
+			if (f->state == HTTP_FETCH_TLS)
+				reqs[i] = http_get(urls[i]);
+		}
+		if (reqs[i] == NULL)
+			failed++;
+	}
+
+	free(fetches);
+	return failed;
+}
+
+/*
+ * Run a batch with non-blocking sockets, keeping up to fetch_concurrency of
+ * them in flight and waiting on all of them at once with poll(2)
+ */
+static void
+http_fetch_poll(struct http_fetch *fetches, int n)
+{
+	struct http_fetch *f;
+	struct pollfd *pfd;
+	char data[16 * 1024];
+	ssize_t ret;
+	int *active, nactive = 0, next = 0, i;
+
+	pfd = calloc(fetch_concurrency, sizeof(struct pollfd));
+	active = calloc(fetch_concurrency, sizeof(int));
+	if (pfd == NULL || active == NULL)
+		err(1, "calloc");
+
+	for (;;) {
+		for (; next < n && nactive < fetch_concurrency; next++) {
+			f = &fetches[next];
+			if (f->state != HTTP_FETCH_READY)
+				continue;
+
+			f->req->socket = socket(f->addr.ss_family,
+			    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (f->req->socket == -1)
+				err(1, "socket");
+			if (f->addr.ss_family == AF_INET)
+				http_tune(f->req->socket);
+			if (connect(f->req->socket, (struct sockaddr *)&f->addr,
+			    f->addrlen) == -1 && errno != EINPROGRESS) {
+				http_fetch_done(f, errno);
+				continue;
+			}
+
+			f->state = HTTP_FETCH_SENDING;
+			active[nactive++] = next;
+		}
+
+		if (nactive <= 0)
+			break;
+
+		for (i = 0; i < nactive; i++) {
+			f = &fetches[active[i]];
+			pfd[i].fd = f->req->socket;
+			pfd[i].events = (f->state == HTTP_FETCH_SENDING ?
+			    POLLOUT : POLLIN);
+			pfd[i].revents = 0;
+		}
+
+		if (poll(pfd, nactive, HTTP_TIMEOUT * 1000) <= 0) {
+			for (i = 0; i < nactive; i++)
+				http_fetch_done(&fetches[active[i]], ETIMEDOUT);
+			nactive = 0;
+			continue;
+		}
+
+		for (i = 0; i < nactive; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			f = &fetches[active[i]];
+
+			if (f->state == HTTP_FETCH_SENDING) {
+				/* a failed connect shows up here */
+				ret = send(f->req->socket,
+				    f->req->message + f->sent, f->len - f->sent,
+				    MSG_NOSIGNAL);
+				if (ret == -1 && errno == EAGAIN)
+					continue;
+				if (ret == -1) {
+					http_fetch_done(f, errno);
+					continue;
+				}
+				f->sent += ret;
+				if (f->sent == f->len)
+					f->state = HTTP_FETCH_RECEIVING;
+				continue;
+			}
+
+			ret = read(f->req->socket, data, sizeof(data));
+			if (ret == -1 && errno == EAGAIN)
+				continue;
+			if (ret == -1)
+				http_fetch_done(f, errno);
+			else if (ret == 0)
+				http_fetch_done(f, 0);
+			else if (http_fetch_append(f, data, ret) != 0)
+				http_fetch_done(f, EFBIG);
+		}
+
+		for (i = nactive - 1; i >= 0; i--) {
+			if (fetches[active[i]].state == HTTP_FETCH_DONE ||
+			    fetches[active[i]].state == HTTP_FETCH_FAILED)
+				active[i] = active[--nactive];
+		}
+	}
+
+	free(active);
+	free(pfd);
+}
+
+/* add data read for a request of a batch to its response */
+int
+http_fetch_append(struct http_fetch *fetch, const char *data, size_t len)
+{
+	struct http_request *req = fetch->req;
+	char *nbuf;
+	size_t size;
+
+	if (req->buf_len + len > fetch->max)
+		return -1;
+
+	if (req->buf_len + len > fetch->size) {
+		size = (req->buf_len + len) * 2;
+		if (size > fetch->max)
+			size = fetch->max;
+		nbuf = realloc(req->buf, size);
+		if (nbuf == NULL)
+			err(1, "realloc");
+		req->buf = nbuf;
+		fetch->size = size;
+	}
+
+	memcpy(req->buf + req->buf_len, data, len);
+	req->buf_len += len;
+	return 0;
+}
+
+/*
+ * A backend is finished with a request of a batch, having read the whole
+ * response, or failed with errno error
+ */
+void
+http_fetch_done(struct http_fetch *fetch, int error)
+{
+	struct http_request *req = fetch->req;
+
+	close(req->socket);
+	req->socket = 0;
+
+	if (error == 0 && req->buf_len == 0)
+		error = ECONNRESET;
+	if (error != 0)
+		warnx("failed fetching %s from %s: %s", req->url->path,
+		    req->url->host, strerror(error));
+
+	fetch->state = (error ? HTTP_FETCH_FAILED : HTTP_FETCH_DONE);
+}
+
+/*
+ * Choose how TLS is negotiated: "legacy" takes whatever protocol version and
+ * cipher the server prefers, and "modern" only TLS 1.3 with X25519
+ */
+int
+http_tls_profile(const char *name)
+{
+	if (strcmp(name, "legacy") == 0)
+		tls_modern = 0;
+	else if (strcmp(name, "modern") == 0)
+		tls_modern = 1;
+	else
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Where the time of finished requests went on average, and how TLS
+ * handshakes have gone, if there were any
+ */
+void
+http_report(FILE *out)
+{
+	if (ntimed > 0) {
+		fprintf(out, "%d request%s: %lld us resolving, ", ntimed,
+		    ntimed == 1 ? "" : "s", resolve_us / ntimed);
+		/*
+		 * A deferred connect() sends nothing, so its handshake shows
+		 * up in TLS or waiting for the first byte instead
+		 */
+		if (ndeferred < ntimed)
+			fprintf(out, "%lld us connecting%s",
+			    connect_us / (ntimed - ndeferred),
+			    ndeferred ? " (" : ", ");
+		if (ndeferred)
+			fprintf(out, "%d connect%s deferred to the first "
+			    "write%s", ndeferred, ndeferred == 1 ? "" : "s",
+			    ndeferred < ntimed ? "), " : ", ");
+		fprintf(out, "%lld us in TLS, %lld us to first byte\n",
+		    secure_us / ntimed, first_us / ntimed);
+	}
+
+	if (handshakes == 0)
+		return;
+
+	fprintf(out, "%d TLS handshake%s (%s), %d resumed, "
+	    "%lld.%03lld ms average\n", handshakes,
+	    handshakes == 1 ? "" : "s", tls_modern ? "modern" : "legacy",
+	    resumed, (handshake_us / handshakes) / 1000,
+	    (handshake_us / handshakes) % 1000);
+}
+
+/*
+ * Resolve, connect, and finish any TLS handshake for url, but don't send
+ * anything yet.  This can be done ahead of time and the request sent later
+ * with http_send().  With HTTP/2, this only makes sure there is a connection
+ * to share.
+ */
+struct http_request *
+http_connect(const char *surl)
+{
+	struct http_request *req;
+
+	if (use_h2 && strncmp(surl, "https://", 8) == 0) {
+		req = malloc(sizeof(struct http_request));
+		if (req == NULL)
+			err(1, "malloc");
+		memset(req, 0, sizeof(struct http_request));
+		if ((req->url = url_parse(surl)) == NULL) {
+			free(req);
+			return NULL;
+		}
+
+		switch (h2_open(req)) {
+		case 0:
+			return req;
+		case -1:
+			http_req_free(req);
+			return NULL;
+		}
+		/* the server only speaks HTTP/1 */
+		http_req_free(req);
+	}
+
+	return http_connect_alpn(surl, NULL);
+}
+
+/* the same, offering alpn as the protocols to speak over TLS */
+struct http_request *
+http_connect_alpn(const char *surl, const char *alpn)
 {
 	struct url *url;
 	struct http_request *req;
-	struct hostent *he;
-	struct sockaddr_in addr;
-	size_t len, tlen;
-	char ip_s[16];
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct timeval timeout;
+	char where[NI_MAXHOST + 32];
 #if TLS
 	struct tls_config *tls_config;
-	int tret;
+	struct timespec start, now;
+	const char *ciphers;
+	uint32_t protocols;
+	int tret, session;
 #endif
 
 	url = url_parse(surl);
@@ -160,6 +658,7 @@ http_get(const char *surl)
 		err(1, "malloc");
 	memset(req, 0, sizeof(struct http_request));
 	req->url = url;
+	clock_gettime(CLOCK_MONOTONIC, &req->started);
 
 	if (strcmp(url->scheme, "https") == 0) {
 #if TLS
@@ -169,49 +668,68 @@ http_get(const char *surl)
 #endif
 	}
 
-	he = gethostbyname(req->url->host);
-	if (he == NULL) {
-		warnx("couldn't resolve host %s: %s", req->url->host,
-		    hstrerror(h_errno));
+	if (http_address(req, &addr, &addrlen, where, sizeof(where)) != 0)
 		goto error;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &req->resolved);
 
-	req->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	req->socket = socket(addr.ss_family, SOCK_STREAM, 0);
 	if (req->socket == -1)
 		err(1, "socket");
-
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(url->port);
-	addr.sin_addr = *((struct in_addr *)he->h_addr);
-
-	inet_ntop(AF_INET, &addr.sin_addr, ip_s, sizeof(ip_s));
+	if (addr.ss_family == AF_INET)
+		http_tune(req->socket);
 
 #if DEBUG
-	printf("connecting to %s (%s) %sto fetch %s\n",
-	    req->url->host, ip_s, req->https ? "(with TLS) " : "",
-	    req->url->path);
+	printf("connecting to %s %sto fetch %s\n", where,
+	    req->https ? "(with TLS) " : "", req->url->path);
 #endif
 
-	if (connect(req->socket, (struct sockaddr *)&addr,
-	    sizeof(addr)) == -1) {
-		warn("failed connecting to %s (%s) port %d",
-		  req->url->host, ip_s, req->url->port);
+	if (connect(req->socket, (struct sockaddr *)&addr, addrlen) == -1) {
+		warn("failed connecting to %s", where);
 		goto error;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &req->connected);
+	req->secured = req->connected;
+	if (addr.ss_family == AF_INET)
+		req->deferred = http_deferred(req->socket);
+
+	timeout.tv_sec = HTTP_TIMEOUT;
+	timeout.tv_usec = 0;
+	setsockopt(req->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+	    sizeof(timeout));
 
 #if TLS
 	if (req->https) {
 		tls_config = tls_config_new();
 		if (tls_config == NULL)
 			errx(1, "tls_config allocation failed");
-		if (tls_config_set_protocols(tls_config,
-		    TLS_PROTOCOLS_ALL) != 0)
+		if (tls_modern) {
+			protocols = TLS_PROTOCOL_TLSv1_3;
+			ciphers = "secure";
+		} else if (alpn != NULL) {
+			/* HTTP/2 rules out old protocols and ciphers */
+			protocols = TLS_PROTOCOLS_DEFAULT;
+			ciphers = "secure";
+		} else {
+			protocols = TLS_PROTOCOLS_ALL;
+			ciphers = "legacy";
+		}
+		if (tls_config_set_protocols(tls_config, protocols) != 0)
 			errx(1, "tls set protocols failed: %s",
 			    tls_config_error(tls_config));
-		if (tls_config_set_ciphers(tls_config, "legacy") != 0)
+		if (tls_config_set_ciphers(tls_config, ciphers) != 0)
 			errx(1, "tls set ciphers failed: %s",
 			    tls_config_error(tls_config));
+		if (tls_modern &&
+		    tls_config_set_ecdhecurves(tls_config, "X25519") != 0)
+			errx(1, "tls set curves failed: %s",
+			    tls_config_error(tls_config));
+		if (alpn != NULL && tls_config_set_alpn(tls_config, alpn) != 0)
+			errx(1, "tls set alpn failed: %s",
+			    tls_config_error(tls_config));
+		if ((session = http_tls_session(req->url->host)) != -1 &&
+		    tls_config_set_session_fd(tls_config, session) != 0)
+			warnx("tls set session fd failed: %s",
+			    tls_config_error(tls_config));
 
 		req->tls = tls_client();
 		if (req->tls == NULL)
@@ -220,6 +738,10 @@ http_get(const char *surl)
 		if (tls_configure(req->tls, tls_config) != 0)
 			errx(1, "tls_configure failed: %s",
 			    tls_config_error(tls_config));
+		/* the connection holds its own reference */
+		tls_config_free(tls_config);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
 
 		if (tls_connect_socket(req->tls, req->socket,
 		    req->url->host) != 0) {
@@ -237,9 +759,160 @@ http_get(const char *surl)
 			    req->url->host, tls_error(req->tls));
 			goto error;
 		}
+
+		clock_gettime(CLOCK_MONOTONIC, &req->secured);
+		timespecsub(&req->secured, &start, &now);
+		handshakes++;
+		handshake_us += (now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+		if (tls_conn_session_resumed(req->tls))
+			resumed++;
+#if DEBUG
+		printf("%s %s with %s in %lld us%s\n",
+		    tls_conn_version(req->tls), tls_conn_cipher(req->tls),
+		    req->url->host,
+		    (long long)(now.tv_sec * 1000000) + (now.tv_nsec / 1000),
+		    tls_conn_session_resumed(req->tls) ? ", resumed" : "");
+#endif
+
+#if KTLS
+		req->ktls = http_ktls(req);
+#endif
 	}
 #endif
 
+	return req;
+
+error:
+	http_req_free(req);
+	return NULL;
+}
+
+/*
+ * Find the address to connect to for a request's url, and describe it in
+ * where for messages.  An http+unix url names a local server such as a relay
+ * on a unix domain socket, skipping the resolver and TCP altogether.
+ */
+static int
+http_address(struct http_request *req, struct sockaddr_storage *addr,
+    socklen_t *addrlen, char *where, size_t wlen)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)addr;
+	struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+	struct hostent *he;
+	char ip_s[16];
+
+	memset(addr, 0, sizeof(struct sockaddr_storage));
+
+	if (strcmp(req->url->scheme, "http+unix") == 0) {
+		sun->sun_family = AF_UNIX;
+		if (strlcpy(sun->sun_path, req->url->host,
+		    sizeof(sun->sun_path)) >= sizeof(sun->sun_path)) {
+			warnx("socket path too long: %s", req->url->host);
+			return -1;
+		}
+		*addrlen = sizeof(struct sockaddr_un);
+		snprintf(where, wlen, "%s", req->url->host);
+		return 0;
+	}
+
+	he = gethostbyname(req->url->host);
+	if (he == NULL) {
+		warnx("couldn't resolve host %s: %s", req->url->host,
+		    hstrerror(h_errno));
+		return -1;
+	}
+
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(req->url->port);
+	sin->sin_addr = *((struct in_addr *)he->h_addr);
+	*addrlen = sizeof(struct sockaddr_in);
+
+	inet_ntop(AF_INET, &sin->sin_addr, ip_s, sizeof(ip_s));
+	snprintf(where, wlen, "%s (%s) port %d", req->url->host, ip_s,
+	    req->url->port);
+
+	return 0;
+}
+
+/* send the GET for a connected request's url */
+int
+http_send(struct http_request *req)
+{
+	size_t len;
+#ifdef TCP_QUICKACK
+	int on = 1;
+#endif
+
+	if (req->h2) {
+		if (h2_send(req) != 0)
+			return -1;
+		clock_gettime(CLOCK_MONOTONIC, &req->sent);
+		return 0;
+	}
+
+	len = http_message(req);
+	if (http_req_write(req, req->message, len) != len) {
+		warnx("failed sending request to %s", req->url->host);
+		return -1;
+	}
+
+#ifdef TCP_QUICKACK
+	/*
+	 * Acknowledge each part of the response as it arrives rather than
+	 * making the server wait on a delayed ACK to send more
+	 */
+	if (req->url->port)
+		setsockopt(req->socket, IPPROTO_TCP, TCP_QUICKACK, &on,
+		    sizeof(on));
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &req->sent);
+
+	return 0;
+}
+
+/*
+ * Set up a TCP socket to the API before connecting: send small writes right
+ * away rather than waiting to coalesce them.  The receive buffer is left to
+ * the kernel's autotuning, which grows it well past anything fixed here for
+ * large responses over slow links.  Where supported, connect() returns right
+ * away and the first write goes out with the SYN (TCP Fast Open) once the
+ * server has handed out a cookie on an earlier connection.
+ */
+void
+http_tune(int fd)
+{
+	int on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef TCP_FASTOPEN_CONNECT
+	setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+#endif
+}
+
+/*
+ * Whether connect() returned without a handshake, leaving it to go out with
+ * the first write, which only happens when there was a Fast Open cookie
+ */
+static int
+http_deferred(int fd)
+{
+#if defined(TCP_FASTOPEN_CONNECT) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+		return (info.tcpi_state != TCP_ESTABLISHED);
+#endif
+	return 0;
+}
+
+/* build the GET for a request's url, returning its length */
+static size_t
+http_message(struct http_request *req)
+{
+	size_t len, tlen;
+
 	tlen = 256 + strlen(req->url->host) + strlen(req->url->path);
 	req->message = malloc(tlen);
 	if (req->message == NULL)
@@ -251,7 +924,8 @@ http_get(const char *surl)
 	    "User-Agent: %s\r\n"
 	    "Accept: */*\r\n"
 	    "\r\n",
-	    req->url->path, req->url->host, __progname);
+	    req->url->path, req->url->port ? req->url->host : "localhost",
+	    __progname);
 	if (len > tlen)
 		errx(1, "snprintf overflow");
 
@@ -259,48 +933,246 @@ http_get(const char *surl)
 	printf(">>>[%zu] %s\n", len, req->message);
 #endif
 
-#if TLS
-	if (req->https) {
-		do {
-			tlen = tls_write(req->tls, req->message, len);
-		} while (tlen == TLS_WANT_POLLIN || tlen == TLS_WANT_POLLOUT);
-	} else
-#endif
-	{
-		tlen = write(req->socket, req->message, len);
+	return len;
+}
+
+/*
+ * Whether a connection made ahead of time with http_connect() is still
+ * usable, which it isn't if the server has since closed it or sent anything
+ */
+int
+http_alive(struct http_request *req)
+{
+	struct pollfd pfd;
+
+	if (req != NULL && req->h2)
+		return h2_alive(req);
+	if (req == NULL || req->socket <= 0)
+		return 0;
+
+	pfd.fd = req->socket;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, 0) == 0);
+}
+
+/*
+ * Open a recorded HTTP response (headers and body) on disk and return it as a
+ * request that can be consumed exactly like one returned by http_get()
+ */
+struct http_request *
+http_file_open(const char *path)
+{
+	struct http_request *req;
+
+	req = malloc(sizeof(struct http_request));
+	if (req == NULL)
+		err(1, "malloc");
+	memset(req, 0, sizeof(struct http_request));
+
+	req->socket = open(path, O_RDONLY | O_CLOEXEC);
+	if (req->socket == -1) {
+		warn("failed opening %s", path);
+		req->socket = 0;
+		http_req_free(req);
+		return NULL;
 	}
-	if (tlen != len)
-		err(1, "short write");
 
 	return req;
+}
 
-error:
-	http_req_free(req);
-	return NULL;
+/*
+ * Hedge requests once they have taken longer to start responding than the
+ * given percentile of recent ones, or 0 to never hedge
+ */
+void
+http_hedge_percentile(int percentile)
+{
+	hedge_percentile = percentile;
+}
+
+/*
+ * Wait for a sent request to start responding.  If it hasn't by the time most
+ * recent requests had, it's likely stuck on a slow backend, so send the same
+ * request on a second connection and use whichever answers first, closing
+ * the other.
+ */
+struct http_request *
+http_hedge(struct http_request *req, const char *url)
+{
+	struct http_request *reqs[2] = { req, NULL };
+	struct timespec now;
+	int i, n = 1, ms;
+
+	/*
+	 * A stream shares its connection with the hedge that would be sent,
+	 * so there's nothing to gain by it
+	 */
+	if (req->h2)
+		return h2_response(req);
+
+	if (!hedge_percentile)
+		return req;
+
+	ms = http_hedge_ms();
+	i = http_wait_first(reqs, 1, ms == -1 ? HTTP_TIMEOUT * 1000 : ms);
+	if (i == -1 && ms != -1) {
+#if DEBUG
+		printf("no response from %s after %d ms, hedging\n",
+		    req->url->host, ms);
+#endif
+		if ((reqs[1] = http_connect(url)) != NULL &&
+		    http_send(reqs[1]) == 0)
+			n = 2;
+		i = http_wait_first(reqs, n, HTTP_TIMEOUT * 1000);
+	}
+
+	if (i == -1) {
+		warnx("timed out waiting for a response from %s",
+		    req->url->host);
+		http_req_free(reqs[0]);
+		http_req_free(reqs[1]);
+		return NULL;
+	}
+
+	http_req_free(reqs[!i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ttfb[nttfb++ % HTTP_TTFB_SAMPLES] =
+	    ((now.tv_sec - reqs[i]->sent.tv_sec) * 1000) +
+	    ((now.tv_nsec - reqs[i]->sent.tv_nsec) / 1000000);
+
+	return reqs[i];
+}
+
+/* the hedging percentile of recent times to first byte, or -1 if unknown */
+static int
+http_hedge_ms(void)
+{
+	int sorted[HTTP_TTFB_SAMPLES];
+	int n, ms;
+
+	n = (nttfb < HTTP_TTFB_SAMPLES ? nttfb : HTTP_TTFB_SAMPLES);
+	if (n < HTTP_TTFB_MIN_SAMPLES)
+		return -1;
+
+	memcpy(sorted, ttfb, sizeof(int) * n);
+	qsort(sorted, n, sizeof(int), ttfb_cmp);
+	ms = sorted[((n - 1) * hedge_percentile) / 100];
+	if (ms < HTTP_HEDGE_MIN_MS)
+		ms = HTTP_HEDGE_MIN_MS;
+
+	return ms;
+}
+
+static int
+ttfb_cmp(const void *a, const void *b)
+{
+	return (*(const int *)a - *(const int *)b);
+}
+
+/*
+ * Wait up to ms milliseconds for any of reqs to start responding, and return
+ * its index, or -1 if none did
+ */
+static int
+http_wait_first(struct http_request **reqs, int n, int ms)
+{
+	struct pollfd pfd[2];
+	struct timespec start, now;
+	int i, left;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = ms - (((now.tv_sec - start.tv_sec) * 1000) +
+		    ((now.tv_nsec - start.tv_nsec) / 1000000));
+		if (left < 0)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			pfd[i].fd = reqs[i]->socket;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, n, left) <= 0)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			if (pfd[i].revents && http_req_probe(reqs[i]))
+				return i;
+		}
+	}
+}
+
+/*
+ * A request's socket is readable, but over TLS that may just be a session
+ * ticket rather than the start of the response, so read what there is
+ * without blocking and keep it for the reader
+ */
+static int
+http_req_probe(struct http_request *req)
+{
+#if TLS
+	ssize_t ret;
+	int flags;
+
+	if (req->https) {
+#if KTLS
+		if (req->ktls) {
+			ret = http_ktls_read(req, req->chunk,
+			    sizeof(req->chunk), MSG_DONTWAIT);
+			if (ret == -1 && errno == EAGAIN)
+				return 0;
+		} else
+#endif
+		{
+			flags = fcntl(req->socket, F_GETFL);
+			fcntl(req->socket, F_SETFL, flags | O_NONBLOCK);
+			ret = tls_read(req->tls, req->chunk,
+			    sizeof(req->chunk));
+			fcntl(req->socket, F_SETFL, flags);
+			if (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT)
+				return 0;
+		}
+		if (ret > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &req->first);
+			req->chunk_len = ret;
+			req->chunk_off = 0;
+		}
+		/* or EOF or an error, which the reader will see again */
+	}
+#endif
+	return 1;
 }
 
 ssize_t
 http_req_read(struct http_request *req, char *data, size_t len)
 {
-	fd_set fds;
-	struct timeval timeout;
 	ssize_t ret;
 
+	if (req && req->buf) {
+		ret = req->buf_len - req->buf_off;
+		if (ret > len)
+			ret = len;
+		memcpy(data, req->buf + req->buf_off, ret);
+		req->buf_off += ret;
+		return ret;
+	}
+
 	if (!req || !req->socket)
 		return -1;
 
-	FD_ZERO(&fds);
-	FD_SET(req->socket, &fds);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 0;
-
-	switch (select(req->socket + 1, &fds, NULL, NULL, &timeout)) {
-	case -1:
-		err(1, "select");
-	case 0:
-		return 0;
-	}
-
+	/*
+	 * The socket has a receive timeout (see http_get), so this blocks
+	 * until there is data, EOF (0), or an error or timeout (-1)
+	 */
+#if KTLS
+	if (req->ktls)
+		ret = http_ktls_read(req, data, len, 0);
+	else
+#endif
 #if TLS
 	if (req->https) {
 		do {
@@ -315,6 +1187,9 @@ http_req_read(struct http_request *req, char *data, size_t len)
 	printf("<<<[%zu] %s\n", len, data);
 #endif
 
+	if (ret > 0 && req->first.tv_sec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &req->first);
+
 	if (ret == -1) {
 #if TLS
 		if (req->https) {
@@ -331,28 +1206,162 @@ http_req_read(struct http_request *req, char *data, size_t len)
 	return ret;
 }
 
+#if TLS
+/*
+ * The file libtls keeps a host's session in, so later connections can resume
+ * it rather than doing a full handshake, or -1 if there's no room for another
+ */
+static int
+http_tls_session(const char *host)
+{
+	int i;
+
+	for (i = 0; i < HTTP_MAX_SESSIONS && sessions[i].host != NULL; i++) {
+		if (strcmp(sessions[i].host, host) == 0)
+			return fileno(sessions[i].file);
+	}
+	if (i == HTTP_MAX_SESSIONS)
+		return -1;
+
+	/* libtls insists on a file only we can read */
+	if ((sessions[i].file = tmpfile()) == NULL) {
+		warn("tmpfile");
+		return -1;
+	}
+	sessions[i].host = strdup(host);
+	if (sessions[i].host == NULL)
+		err(1, "strdup");
+
+	return fileno(sessions[i].file);
+}
+#endif
+
+#if KTLS
+/*
+ * Whether the TLS library handed decryption of a request's connection to the
+ * kernel after the handshake, in which case reading the socket yields
+ * plaintext and there's no reason to go through the library for it.  libtls
+ * doesn't expose the session keys to install them ourselves, but it does this
+ * on Linux when it's libretls on an OpenSSL built with kTLS and configured
+ * with "Options = KTLS".  Anywhere else this just finds nothing installed.
+ */
+static int
+http_ktls(struct http_request *req)
+{
+	struct tls_crypto_info info;
+	socklen_t len = sizeof(info);
+
+	/* only the header, the kernel copies out the keys given room */
+	if (getsockopt(req->socket, SOL_TLS, TLS_RX, &info, &len) != 0)
+		return 0;
+
+#if DEBUG
+	printf("kernel TLS %04x cipher %d decrypting %s\n", info.version,
+	    info.cipher_type, req->url->host);
+#endif
+	return 1;
+}
+
+/*
+ * Read plaintext from a kernel TLS socket, which hands over records of other
+ * types with the type in a control message.  A handshake message after the
+ * handshake, such as a session ticket, would have been consumed by the TLS
+ * library and is skipped, and an alert ends the response.
+ */
+static ssize_t
+http_ktls_read(struct http_request *req, char *data, size_t len, int flags)
+{
+	char control[CMSG_SPACE(sizeof(unsigned char))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t ret;
+
+	for (;;) {
+		iov.iov_base = data;
+		iov.iov_len = len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ret = recvmsg(req->socket, &msg, flags);
+		if (ret == -1)
+			return -1;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || cmsg->cmsg_level != SOL_TLS ||
+		    cmsg->cmsg_type != TLS_GET_RECORD_TYPE)
+			return ret;
+
+		switch (*CMSG_DATA(cmsg)) {
+		case HTTP_TLS_APPLICATION_DATA:
+			return ret;
+		case HTTP_TLS_ALERT:
+			return 0;
+		}
+	}
+}
+#endif
+
+ssize_t
+http_req_write(struct http_request *req, const char *data, size_t len)
+{
+	ssize_t ret;
+
+#if TLS
+	if (req->https) {
+		do {
+			ret = tls_write(req->tls, data, len);
+		} while (ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT);
+	} else
+#endif
+	{
+		ret = write(req->socket, data, len);
+	}
+
+	return ret;
+}
+
 int
 http_req_skip_header(struct http_request *req)
 {
-	size_t len, n;
+	ssize_t len;
+	size_t n;
+	char status_line[32];
+	int first = 1;
 
 	for (;;) {
-		if (req->chunk_len > 3) {
-			/*
-			 * Leave last 3 bytes of previous read in case \r\n\r\n
-			 * happens across reads.
-			 */
-			memmove(req->chunk, req->chunk + req->chunk_len - 3,
-			  req->chunk_len - 3);
-			req->chunk_len = 3;
+		/* http_hedge may have already read the start of it */
+		if (!first || req->chunk_len == 0) {
+			if (req->chunk_len > 3) {
+				/*
+				 * Leave last 3 bytes of previous read in case
+				 * \r\n\r\n happens across reads.
+				 */
+				memmove(req->chunk,
+				    req->chunk + req->chunk_len - 3, 3);
+				req->chunk_len = 3;
+			}
+			len = http_req_read(req, req->chunk + req->chunk_len,
+			  sizeof(req->chunk) - req->chunk_len);
+			if (len <= 0)
+				return 0;
+			req->chunk_len += len;
+		}
+
+		if (first) {
+			/* HTTP/1.1 200 OK */
+			n = req->chunk_len < sizeof(status_line) ?
+			    req->chunk_len : sizeof(status_line) - 1;
+			memcpy(status_line, req->chunk, n);
+			status_line[n] = '\0';
+			if (sscanf(status_line, "HTTP/%*d.%*d %d",
+			    &req->status) != 1)
+				req->status = 0;
+			first = 0;
 		}
-		len = http_req_read(req, req->chunk + req->chunk_len,
-		  sizeof(req->chunk) - req->chunk_len);
-		if (len < 0)
-			return 0;
-		if (len == 0)
-			continue;
-		req->chunk_len += len;
 
 		for (n = 3; n < req->chunk_len; n++) {
 			if (req->chunk[n - 3] != '\r' ||
@@ -431,12 +1440,68 @@ http_req_byte_read(struct http_request *req)
 	return c;
 }
 
+/*
+ * Read the rest of the response body (after http_req_skip_header) into a
+ * newly allocated, NUL-terminated buffer of at most max bytes
+ */
+char *
+http_req_body(struct http_request *req, size_t *len, size_t max)
+{
+	char *body = NULL, *chunk, *nbody;
+	size_t size = 0, clen;
+
+	*len = 0;
+
+	while ((chunk = http_req_chunk_peek(req)) != NULL) {
+		clen = req->chunk_len - req->chunk_off;
+		http_req_chunk_read(req);
+		if (*len + clen > max) {
+			warnx("response from %s too large",
+			    req->url ? req->url->host : "file");
+			free(body);
+			return NULL;
+		}
+		if (*len + clen + 1 > size) {
+			size = (*len + clen + 1) * 2;
+			nbody = realloc(body, size);
+			if (nbody == NULL)
+				err(1, "realloc");
+			body = nbody;
+		}
+		memcpy(body + *len, chunk, clen);
+		*len += clen;
+	}
+
+	if (body == NULL) {
+		body = malloc(1);
+		if (body == NULL)
+			err(1, "malloc");
+	}
+	body[*len] = '\0';
+
+	return body;
+}
+
 void
 http_req_free(struct http_request *req)
 {
 	if (req == NULL)
 		return;
 
+	if (req->started.tv_sec != 0 && req->first.tv_sec != 0) {
+		ntimed++;
+		resolve_us += http_us(&req->started, &req->resolved);
+		if (req->deferred)
+			ndeferred++;
+		else
+			connect_us += http_us(&req->resolved,
+			    &req->connected);
+		secure_us += http_us(&req->connected, &req->secured);
+		first_us += http_us(&req->sent, &req->first);
+	}
+
+	if (req->h2)
+		h2_cancel(req);
 #if TLS
 	if (req->https && req->tls) {
 		tls_close(req->tls);
@@ -448,6 +1513,18 @@ http_req_free(struct http_request *req)
 		close(req->socket);
 	if (req->message != NULL)
 		free(req->message);
+	if (req->buf != NULL)
+		free(req->buf);
 	if (req->url)
 		free(req->url);
+	free(req);
+}
+
+static long long
+http_us(const struct timespec *from, const struct timespec *to)
+{
+	struct timespec delta;
+
+	timespecsub(to, from, &delta);
+	return ((long long)delta.tv_sec * 1000000) + (delta.tv_nsec / 1000);
 }
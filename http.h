@@ -19,6 +19,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <stdio.h>
+#include <time.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -30,6 +32,33 @@
 
 #include "util.h"
 
+/* seconds to wait for a response before giving up */
+#define HTTP_TIMEOUT	30
+
+/* recent times to first byte kept to decide when to hedge */
+#define HTTP_TTFB_SAMPLES	32
+/* and how many are needed before hedging at all */
+#define HTTP_TTFB_MIN_SAMPLES	5
+/* never hedge sooner than this many milliseconds */
+#define HTTP_HEDGE_MIN_MS	100
+
+/* hosts whose TLS sessions are kept to resume */
+#define HTTP_MAX_SESSIONS	8
+
+/* requests that can be sent ahead with http_start() */
+#define HTTP_MAX_STARTED	32
+
+#if KTLS
+/* TLS record types a kernel TLS socket passes along */
+#define HTTP_TLS_ALERT			21
+#define HTTP_TLS_APPLICATION_DATA	23
+#endif
+
+/* requests http_fetch_all() has in flight at once unless told otherwise */
+#define HTTP_FETCH_CONCURRENCY	64
+
+struct h2_conn;
+
 struct url {
 	char *scheme;
 	char *host;
@@ -45,25 +74,88 @@ struct http_request {
 #if TLS
 	struct tls *tls;
 #endif
+#if KTLS
+	int ktls;		/* the kernel is decrypting */
+#endif
+
+	/* or a stream on a shared HTTP/2 connection */
+	struct h2_conn *h2;
+	unsigned int stream;
 
 	char *message;
 	int status;
 
+	/* when each step of the request happened, for http_report() */
+	struct timespec started;
+	struct timespec resolved;
+	struct timespec connected;
+	struct timespec secured;
+	struct timespec sent;
+	struct timespec first;
+	int deferred;		/* connect() waited for the first write */
+
+	/* a response already read into memory, such as over HTTP/2 */
+	char *buf;
+	size_t buf_len;
+	size_t buf_off;
+
 	char chunk[2048];
 	ssize_t chunk_len;
 	ssize_t chunk_off;
 };
 
+/* one request of a batch being fetched by http_fetch_all() */
+enum http_fetch_state {
+	HTTP_FETCH_READY,
+	HTTP_FETCH_SENDING,
+	HTTP_FETCH_RECEIVING,
+	HTTP_FETCH_DONE,
+	HTTP_FETCH_FAILED,
+	HTTP_FETCH_TLS,		/* left to http_get() */
+};
+
+struct http_fetch {
+	struct http_request *req;
+	enum http_fetch_state state;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	size_t len;		/* of req->message */
+	size_t sent;
+	size_t size;		/* of req->buf */
+	size_t max;
+};
+
 struct url * url_parse(const char *str);
 char * url_encode(unsigned char *str);
 
 struct http_request * http_get(const char *url);
+struct http_request * http_connect(const char *url);
+struct http_request * http_connect_alpn(const char *url, const char *alpn);
+int http_send(struct http_request *req);
+int http_start(const char *url);
+int http_fetch_all(const char **urls, int n, struct http_request **reqs,
+    size_t max);
+int http_fetch_backend(const char *name, int concurrency);
+int http_fetch_append(struct http_fetch *fetch, const char *data,
+    size_t len);
+void http_fetch_done(struct http_fetch *fetch, int error);
+void http_h2(int enable);
+int http_tls_profile(const char *name);
+void http_report(FILE *out);
+void http_tune(int fd);
+int http_alive(struct http_request *req);
+void http_hedge_percentile(int percentile);
+struct http_request * http_hedge(struct http_request *req, const char *url);
+struct http_request * http_file_open(const char *path);
 ssize_t http_req_read(struct http_request *req, char *data, size_t len);
+ssize_t http_req_write(struct http_request *req, const char *data,
+    size_t len);
 int http_req_skip_header(struct http_request *req);
 char http_req_byte_peek(struct http_request *req);
 char http_req_byte_read(struct http_request *req);
 char *http_req_chunk_peek(struct http_request *req);
 char *http_req_chunk_read(struct http_request *req);
+char *http_req_body(struct http_request *req, size_t *len, size_t max);
 void http_req_free(struct http_request *req);
 
 #endif
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <endian.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mcast.h"
+
+/*
+ * Observations are shared on the LAN as small datagrams to a multicast group.
+ * Every instance listens, and whenever one hears an observation for its own
+ * location it takes it as if it had fetched it and pushes its own next fetch
+ * back by an interval plus a per-node grace period.  So whichever instance's
+ * timer fires first becomes the publisher for that location and everyone else
+ * stays quiet, and when it goes away the one with the next shortest grace
+ * period takes over.  A new instance asks the group for the latest
+ * observation so it doesn't have to fetch on startup either, which only the
+ * current publisher answers.
+ */
+
+#define MCAST_MAGIC	0x7877696d	/* "xwim" */
+#define MCAST_VERSION	2
+
+enum {
+	MCAST_OBSERVATION = 1,
+	MCAST_QUERY,
+};
+
+struct mcast_packet {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t type;
+	uint8_t night;
+	uint8_t humidity;
+	uint16_t weather_id;
+	uint16_t pressure;
+	uint32_t seq;
+	int32_t temp;		/* hundredths of a degree */
+	uint64_t node;
+	int64_t time;
+	char key[32];
+	char description[64];
+} __attribute__((packed));
+
+static int sock = -1;
+static struct sockaddr_in group;
+static uint64_t node_id;
+static uint32_t seq = 0;
+static uint64_t last_node = 0;
+static uint32_t last_seq = 0;
+static struct mcast_packet last_pkt;
+static int publishing = 0;
+
+static int	mcast_recv(const char *key, struct observation *obs);
+
+void
+mcast_open(const char *spec)
+{
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	char host[INET_ADDRSTRLEN];
+	const char *port;
+	unsigned char ttl = 1, loop = 1;
+	int on = 1;
+
+	/* group:port */
+	if ((port = strrchr(spec, ':')) == NULL || port - spec >= sizeof(host))
+		errx(1, "multicast group must be address:port");
+	memcpy(host, spec, port - spec);
+	host[port - spec] = '\0';
+	port++;
+
+	memset(&group, 0, sizeof(group));
+	group.sin_family = AF_INET;
+	if (inet_pton(AF_INET, host, &group.sin_addr) != 1 ||
+	    !IN_MULTICAST(ntohl(group.sin_addr.s_addr)))
+		errx(1, "bad multicast group %s", host);
+	if (atoi(port) < 1 || atoi(port) > 65535)
+		errx(1, "bad multicast port %s", port);
+	group.sin_port = htons(atoi(port));
+
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock == -1)
+		err(1, "socket");
+
+	/* let every instance on the host listen */
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = group.sin_addr;
+	addr.sin_port = group.sin_port;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(1, "bind %s", spec);
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_multiaddr = group.sin_addr;
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+	    sizeof(mreq)) == -1)
+		err(1, "joining multicast group %s", host);
+
+	/* stay on the LAN, and hear other instances on this host */
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+	node_id = ((uint64_t)arc4random() << 32) | arc4random();
+}
+
+int
+mcast_pollfds(struct pollfd *pfd, int max)
+{
+	if (sock == -1 || max < 1)
+		return 0;
+
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	return 1;
+}
+
+/*
+ * Drain any datagrams, returning 1 and filling in obs if a new observation for
+ * key arrived from another node
+ */
+int
+mcast_handle(struct pollfd *pfd, int n, const char *key,
+    struct observation *obs)
+{
+	if (n < 1 || pfd[0].revents == 0)
+		return 0;
+
+	return mcast_recv(key, obs);
+}
+
+/* ask whoever is publishing key for their latest and wait up to secs for it */
+int
+mcast_query(const char *key, struct observation *obs, int secs)
+{
+	struct mcast_packet pkt;
+	struct pollfd pfd;
+	struct timespec start, now;
+	int elapsed;
+
+	if (sock == -1)
+		return 0;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.magic = htonl(MCAST_MAGIC);
+	pkt.version = MCAST_VERSION;
+	pkt.type = MCAST_QUERY;
+	pkt.node = htobe64(node_id);
+	snprintf(pkt.key, sizeof(pkt.key), "%s", key);
+	if (sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *)&group,
+	    sizeof(group)) != sizeof(pkt))
+		warn("multicast sendto");
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed >= secs * 1000)
+			return 0;
+		if (poll(&pfd, 1, secs * 1000 - elapsed) < 1)
+			continue;
+		if (mcast_recv(key, obs))
+			return 1;
+	}
+}
+
+static int
+mcast_recv(const char *key, struct observation *obs)
+{
+	struct mcast_packet pkt;
+	ssize_t len;
+	uint64_t node;
+	uint32_t pseq;
+	int got = 0;
+
+	while ((len = recv(sock, &pkt, sizeof(pkt), 0)) != -1) {
+		if (len != sizeof(pkt) || ntohl(pkt.magic) != MCAST_MAGIC ||
+		    pkt.version != MCAST_VERSION)
+			continue;
+
+		node = be64toh(pkt.node);
+		if (node == node_id)
+			continue;
+
+		pkt.key[sizeof(pkt.key) - 1] = '\0';
+		if (key == NULL || strcmp(pkt.key, key) != 0)
+			continue;
+
+		if (pkt.type == MCAST_QUERY) {
+			if (publishing && sendto(sock, &last_pkt,
+			    sizeof(last_pkt), 0, (struct sockaddr *)&group,
+			    sizeof(group)) != sizeof(last_pkt))
+				warn("multicast sendto");
+			continue;
+		}
+		if (pkt.type != MCAST_OBSERVATION)
+			continue;
+
+		/* someone else has it covered */
+		publishing = 0;
+
+		/* drop duplicates and stragglers from the same publisher */
+		pseq = ntohl(pkt.seq);
+		if (node == last_node && (int32_t)(pseq - last_seq) <= 0)
+			continue;
+		last_node = node;
+		last_seq = pseq;
+
+		memset(obs, 0, sizeof(struct observation));
+		obs->time = (time_t)be64toh(pkt.time);
+		obs->temp = (int32_t)ntohl(pkt.temp) / 100.0;
+		obs->weather_id = ntohs(pkt.weather_id);
+		obs->night = pkt.night;
+		obs->humidity = pkt.humidity;
+		obs->pressure = ntohs(pkt.pressure);
+		memcpy(obs->description, pkt.description,
+		    sizeof(obs->description));
+		obs->description[sizeof(obs->description) - 1] = '\0';
+		got = 1;
+
+#if DEBUG
+		printf("mcast: observation %u for %s from %016llx\n", pseq,
+		    key, (unsigned long long)node);
+#endif
+	}
+
+	return got;
+}
+
+void
+mcast_publish(const char *key, const struct observation *obs)
+{
+	struct mcast_packet pkt;
+
+	if (sock == -1)
+		return;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.magic = htonl(MCAST_MAGIC);
+	pkt.version = MCAST_VERSION;
+	pkt.type = MCAST_OBSERVATION;
+	pkt.night = obs->night;
+	pkt.humidity = obs->humidity;
+	pkt.pressure = htons(obs->pressure);
+	pkt.weather_id = htons(obs->weather_id);
+	pkt.seq = htonl(++seq);
+	pkt.temp = htonl((int32_t)(obs->temp * 100));
+	pkt.node = htobe64(node_id);
+	pkt.time = htobe64((int64_t)obs->time);
+	snprintf(pkt.key, sizeof(pkt.key), "%s", key);
+	snprintf(pkt.description, sizeof(pkt.description), "%s",
+	    obs->description);
+
+	if (sendto(sock, &pkt, sizeof(pkt), 0, (struct sockaddr *)&group,
+	    sizeof(group)) != sizeof(pkt))
+		warn("multicast sendto");
+
+	memcpy(&last_pkt, &pkt, sizeof(last_pkt));
+	publishing = 1;
+}
+
+/*
+ * How much longer than the interval to wait after hearing from a publisher
+ * before assuming it's gone and fetching ourselves, spread per node so that
+ * only one listener takes over
+ */
+int
+mcast_grace(int interval)
+{
+	int spread = interval / 4;
+
+	if (spread < 1)
+		spread = 1;
+
+	return 1 + (node_id % spread);
+}
+
+void
+mcast_close(void)
+{
+	if (sock == -1)
+		return;
+
+	close(sock);
+	sock = -1;
+}
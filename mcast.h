@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __MCAST_H__
+#define __MCAST_H__
+
+#include <poll.h>
+
+#include "observation.h"
+
+/* how long a new instance waits for an answer before fetching itself */
+#define MCAST_QUERY_WAIT	2
+
+void	mcast_open(const char *spec);
+int	mcast_pollfds(struct pollfd *pfd, int max);
+int	mcast_handle(struct pollfd *pfd, int n, const char *key,
+	    struct observation *obs);
+int	mcast_query(const char *key, struct observation *obs, int secs);
+void	mcast_publish(const char *key, const struct observation *obs);
+int	mcast_grace(int interval);
+void	mcast_close(void);
+
+#endif
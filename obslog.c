@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "obslog.h"
+#include "cache.h"
+#include "alloc.h"
+
+/*
+ * Long-term history is appended to a log next to each location's cache file.
+ * The log is a sequence of self-describing blocks, each holding a batch of
+ * observations stored column by column: times, temperatures, humidity,
+ * pressure and condition ids, each as zigzag varint deltas from the previous
+ * value.  Since the values barely move between observations, most of them
+ * fit in a single byte.
+ *
+ * Each block carries its time range and a CRC-32 of its payload, so a query
+ * can skip blocks outside of its range without decoding them, and a block
+ * torn by a crash is skipped over rather than ending the log.
+ */
+
+#define OBSLOG_MAGIC	0x78776c31	/* "xwl1" */
+
+struct obslog_block {
+	uint32_t magic;
+	uint16_t count;
+	uint16_t flags;
+	uint32_t len;		/* payload bytes following */
+	uint32_t crc;		/* of the payload */
+	int64_t first;		/* time of the first and last observation */
+	int64_t last;
+};
+
+/* 5 columns of at most 10 bytes per value */
+#define OBSLOG_MAX_PAYLOAD	(OBSLOG_BATCH * 5 * 10)
+
+struct obslog_row {
+	int64_t time;
+	int64_t temp;		/* hundredths of a degree */
+	int64_t humidity;
+	int64_t pressure;
+	int64_t weather_id;
+};
+
+struct obslog_day {
+	char date[16];
+	int64_t n, min, max, sum, humidity, pressure;
+};
+
+static char pending_key[PATH_MAX];
+static struct obslog_row pending[OBSLOG_BATCH];
+static int npending = 0;
+
+static uint32_t	crc32(const uint8_t *buf, size_t len);
+static size_t	put_varint(uint8_t *p, int64_t v);
+static int	get_varint(const uint8_t **p, const uint8_t *end, int64_t *v);
+static size_t	obslog_encode(uint8_t *buf);
+static int	obslog_decode(const struct obslog_block *blk,
+		    const uint8_t *payload, struct obslog_row *rows);
+static void	obslog_day(struct obslog_day *day, FILE *out);
+
+void
+obslog_add(const char *key, const struct observation *obs)
+{
+	struct obslog_row *row;
+
+	if (npending && strcmp(key, pending_key) != 0)
+		obslog_flush();
+
+	if (npending == 0)
+		strlcpy(pending_key, key, sizeof(pending_key));
+
+	row = &pending[npending++];
+	row->time = obs->time;
+	row->temp = obs->temp * 100;
+	row->humidity = obs->humidity;
+	row->pressure = obs->pressure;
+	row->weather_id = obs->weather_id;
+
+	if (npending == OBSLOG_BATCH ||
+	    obs->time - pending[0].time >= OBSLOG_FLUSH_SECS)
+		obslog_flush();
+}
+
+void
+obslog_flush(void)
+{
+	struct obslog_block blk;
+	uint8_t buf[sizeof(blk) + OBSLOG_MAX_PAYLOAD];
+	char path[PATH_MAX];
+	size_t len;
+	int fd;
+
+	if (npending == 0)
+		return;
+
+	len = obslog_encode(buf + sizeof(blk));
+
+	memset(&blk, 0, sizeof(blk));
+	blk.magic = OBSLOG_MAGIC;
+	blk.count = npending;
+	blk.len = len;
+	blk.crc = crc32(buf + sizeof(blk), len);
+	blk.first = pending[0].time;
+	blk.last = pending[npending - 1].time;
+	memcpy(buf, &blk, sizeof(blk));
+	len += sizeof(blk);
+
+	npending = 0;
+
+	if (cache_path(pending_key, ".log", path, sizeof(path)) != 0)
+		return;
+
+	/* one write per block so concurrent appenders can't interleave */
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		warn("failed opening history log %s", path);
+		return;
+	}
+	flock(fd, LOCK_EX);
+	if (write(fd, buf, len) != len)
+		warn("failed appending to history log %s", path);
+	close(fd);
+}
+
+/*
+ * Print a daily summary of every observation logged for key since the given
+ * time.  The log is mapped and walked in place, only decoding the blocks that
+ * fall within range.
+ */
+int
+obslog_query(const char *key, time_t since, FILE *out)
+{
+	struct obslog_block blk;
+	struct obslog_row rows[OBSLOG_BATCH];
+	struct stat sb;
+	struct tm tm;
+	const uint8_t *map, *p, *end;
+	struct obslog_day day;
+	char path[PATH_MAX], date[16];
+	uint32_t magic = OBSLOG_MAGIC;
+	int i, fd, nrows, bad = 0;
+	time_t t;
+
+	if (cache_path(key, ".log", path, sizeof(path)) != 0)
+		return -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		warn("%s", path);
+		return -1;
+	}
+	if (fstat(fd, &sb) == -1) {
+		warn("fstat %s", path);
+		close(fd);
+		return -1;
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("mmap %s", path);
+		return -1;
+	}
+	madvise((void *)map, sb.st_size, MADV_SEQUENTIAL);
+
+	memset(&day, 0, sizeof(day));
+	fprintf(out, "# date\tcount\tmin\tmean\tmax\thumidity\tpressure\n");
+
+	p = map;
+	end = map + sb.st_size;
+	while (end - p >= (ssize_t)sizeof(blk)) {
+		memcpy(&blk, p, sizeof(blk));
+		if (blk.magic != OBSLOG_MAGIC || blk.count == 0 ||
+		    blk.count > OBSLOG_BATCH || blk.len > end - p - sizeof(blk))
+			goto resync;
+		if (blk.last < since) {
+			p += sizeof(blk) + blk.len;
+			continue;
+		}
+		if (crc32(p + sizeof(blk), blk.len) != blk.crc)
+			goto resync;
+		nrows = obslog_decode(&blk, p + sizeof(blk), rows);
+		if (nrows == -1)
+			goto resync;
+		p += sizeof(blk) + blk.len;
+
+		for (i = 0; i < nrows; i++) {
+			if (rows[i].time < since)
+				continue;
+			t = rows[i].time;
+			localtime_r(&t, &tm);
+			strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+			if (strcmp(date, day.date) != 0) {
+				obslog_day(&day, out);
+				strlcpy(day.date, date, sizeof(day.date));
+				day.min = day.max = rows[i].temp;
+			}
+			day.n++;
+			day.sum += rows[i].temp;
+			day.humidity += rows[i].humidity;
+			day.pressure += rows[i].pressure;
+			if (rows[i].temp < day.min)
+				day.min = rows[i].temp;
+			if (rows[i].temp > day.max)
+				day.max = rows[i].temp;
+		}
+		continue;
+
+resync:
+		/* torn or corrupt, pick up again at the next block */
+		bad++;
+		p = memmem(p + 1, end - p - 1, &magic, sizeof(magic));
+		if (p == NULL)
+			break;
+	}
+
+	obslog_day(&day, out);
+
+	munmap((void *)map, sb.st_size);
+
+	if (bad)
+		warnx("%s: skipped %d damaged block%s", path, bad,
+		    bad == 1 ? "" : "s");
+
+	return 0;
+}
+
+/* print a finished day and start over */
+static void
+obslog_day(struct obslog_day *day, FILE *out)
+{
+	if (day->n)
+		fprintf(out, "%s\t%lld\t%.1f\t%.1f\t%.1f\t%lld\t%lld\n",
+		    day->date, (long long)day->n, day->min / 100.0,
+		    day->sum / 100.0 / day->n, day->max / 100.0,
+		    (long long)(day->humidity / day->n),
+		    (long long)(day->pressure / day->n));
+
+	memset(day, 0, sizeof(struct obslog_day));
+}
+
+static size_t
+obslog_encode(uint8_t *buf)
+{
+	size_t len = 0;
+	int i;
+
+#define COLUMN(f) \
+	for (i = 0; i < npending; i++) \
+		len += put_varint(buf + len, pending[i].f - \
+		    (i ? pending[i - 1].f : 0));
+
+	/* the first time is in the header, so its delta is always 0 */
+	for (i = 1; i < npending; i++)
+		len += put_varint(buf + len,
+		    pending[i].time - pending[i - 1].time);
+	COLUMN(temp);
+	COLUMN(humidity);
+	COLUMN(pressure);
+	COLUMN(weather_id);
+#undef COLUMN
+
+	return len;
+}
+
+static int
+obslog_decode(const struct obslog_block *blk, const uint8_t *payload,
+    struct obslog_row *rows)
+{
+	const uint8_t *p = payload, *end = payload + blk->len;
+	int64_t v;
+	int i;
+
+#define COLUMN(f) \
+	for (i = 0; i < blk->count; i++) { \
+		if (get_varint(&p, end, &v) == -1) \
+			return -1; \
+		rows[i].f = v + (i ? rows[i - 1].f : 0); \
+	}
+
+	rows[0].time = blk->first;
+	for (i = 1; i < blk->count; i++) {
+		if (get_varint(&p, end, &v) == -1)
+			return -1;
+		rows[i].time = rows[i - 1].time + v;
+	}
+	COLUMN(temp);
+	COLUMN(humidity);
+	COLUMN(pressure);
+	COLUMN(weather_id);
+#undef COLUMN
+
+	return blk->count;
+}
+
+static size_t
+put_varint(uint8_t *p, int64_t v)
+{
+	uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+	size_t n = 0;
+
+	while (u >= 0x80) {
+		p[n++] = (u & 0x7f) | 0x80;
+		u >>= 7;
+	}
+	p[n++] = u;
+
+	return n;
+}
+
+static int
+get_varint(const uint8_t **p, const uint8_t *end, int64_t *v)
+{
+	uint64_t u = 0;
+	int shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (*p >= end)
+			return -1;
+		u |= (uint64_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			*v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static uint32_t
+crc32(const uint8_t *buf, size_t len)
+{
+	static uint32_t table[256];
+	uint32_t c;
+	size_t i;
+	int j;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (j = 0; j < 8; j++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	c = 0xffffffff;
+	for (i = 0; i < len; i++)
+		c = table[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+
+	return c ^ 0xffffffff;
+}
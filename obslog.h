@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __OBSLOG_H__
+#define __OBSLOG_H__
+
+#include <stdio.h>
+
+#include "observation.h"
+
+/* observations buffered before being appended as one block */
+#define OBSLOG_BATCH		32
+
+/* but don't sit on any of them longer than this */
+#define OBSLOG_FLUSH_SECS	(60 * 60 * 6)
+
+void	obslog_add(const char *key, const struct observation *obs);
+void	obslog_flush(void);
+int	obslog_query(const char *key, time_t since, FILE *out);
+
+#endif
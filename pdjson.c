@@ -863,6 +863,65 @@ enum json_type json_skip_until(json_stream *json, enum json_type type)
     return type;
 }
 
+/* Find where each element of the array at the start of buffer begins and
+   ends without parsing it, so the elements can be parsed separately, such as
+   on different threads.  Only strings and nesting are followed, so the
+   elements themselves are not checked.  Each is found from the first byte of
+   its value up to the comma or bracket after it, stopping after max of them,
+   and the number found is returned, or (size_t)-1 if the array isn't closed.
+   Added for xweathericon. */
+size_t json_split_array(const void *buffer, size_t size, size_t *starts,
+                        size_t *ends, size_t max)
+{
+    const char *p = (const char *)buffer;
+    size_t i = 0, n = 0, depth = 0, start = 0;
+    bool value = false;
+
+    while (i < size && json_isspace(p[i]))
+        i++;
+    if (i == size || p[i] != '[')
+        return (size_t)-1;
+
+    for (i++; i < size; i++) {
+        int c = p[i];
+
+        if (json_isspace(c))
+            continue;
+
+        if (depth == 0 && (c == ',' || c == ']')) {
+            if (value) {
+                starts[n] = start;
+                ends[n] = i;
+                if (++n == max)
+                    return n;
+                value = false;
+            }
+            if (c == ']')
+                return n;
+            continue;
+        }
+
+        if (depth == 0 && !value) {
+            start = i;
+            value = true;
+        }
+
+        if (c == '"') {
+            for (i++; i < size && p[i] != '"'; i++)
+                if (p[i] == '\\')
+                    i++;
+        } else if (c == '[' || c == '{') {
+            depth++;
+        } else if (c == ']' || c == '}') {
+            if (depth == 0)
+                return (size_t)-1;
+            depth--;
+        }
+    }
+
+    return (size_t)-1;
+}
+
 const char *json_get_string(json_stream *json, size_t *length)
 {
     if (length != NULL)
@@ -84,6 +84,7 @@ PDJSON_SYMEXPORT double json_get_number(json_stream *json);
 
 PDJSON_SYMEXPORT enum json_type json_skip(json_stream *json);
 PDJSON_SYMEXPORT enum json_type json_skip_until(json_stream *json, enum json_type type);
+PDJSON_SYMEXPORT size_t json_split_array(const void *buffer, size_t size, size_t *starts, size_t *ends, size_t max);
 
 PDJSON_SYMEXPORT size_t json_get_lineno(json_stream *json);
 PDJSON_SYMEXPORT size_t json_get_position(json_stream *json);
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "alloc.h"
+
+/*
+ * Runs a batch of independent tasks, such as parsing each of many responses,
+ * across threads.  The tasks are numbered and split into one contiguous range
+ * per thread up front.  Each thread takes tasks from the front of its own
+ * range, and once that's empty, steals the back half of whichever range has
+ * the most left, so threads that drew cheap tasks help the ones that drew
+ * expensive ones.  A range is a single 64-bit word updated with
+ * compare-and-swap, so neither taking nor stealing a task needs a lock.
+ */
+
+#define RANGE(lo, hi)	(((uint64_t)(lo) << 32) | (uint32_t)(hi))
+#define RANGE_LO(r)	((uint32_t)((r) >> 32))
+#define RANGE_HI(r)	((uint32_t)(r))
+
+struct pool;
+
+struct pool_worker {
+	uint64_t range;		/* next task << 32 | end */
+	pthread_t thread;
+	struct pool *pool;
+};
+
+struct pool {
+	struct pool_worker workers[POOL_MAX_THREADS];
+	int nworkers;
+	void (*fn)(void *, int);
+	void *arg;
+};
+
+static void *	pool_main(void *arg);
+static void	pool_work(struct pool_worker *w);
+static int	pool_take(struct pool_worker *w);
+static int	pool_steal(struct pool_worker *w);
+
+/*
+ * Call fn(arg, task) for every task from 0 to n - 1 on up to nthreads
+ * threads, including this one, and return once they have all finished
+ */
+void
+pool_run(int nthreads, int n, void (*fn)(void *arg, int task), void *arg)
+{
+	struct pool pool;
+	int i, ret;
+
+#if ALLOC_STATS
+	/* the counters aren't atomic */
+	nthreads = 1;
+#endif
+	if (nthreads > POOL_MAX_THREADS)
+		nthreads = POOL_MAX_THREADS;
+	if (nthreads > n)
+		nthreads = n;
+	if (nthreads < 1)
+		return;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.nworkers = nthreads;
+	pool.fn = fn;
+	pool.arg = arg;
+
+	for (i = 0; i < nthreads; i++) {
+		pool.workers[i].pool = &pool;
+		pool.workers[i].range = RANGE((int64_t)n * i / nthreads,
+		    (int64_t)n * (i + 1) / nthreads);
+	}
+
+	for (i = 1; i < nthreads; i++) {
+		ret = pthread_create(&pool.workers[i].thread, NULL, pool_main,
+		    &pool.workers[i]);
+		if (ret != 0)
+			errx(1, "pthread_create: %s", strerror(ret));
+	}
+
+	pool_work(&pool.workers[0]);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+}
+
+/* how many threads are worth running */
+int
+pool_cpus(void)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n < 1 ? 1 : (n > POOL_MAX_THREADS ? POOL_MAX_THREADS : n));
+}
+
+static void *
+pool_main(void *arg)
+{
+	pool_work((struct pool_worker *)arg);
+	return NULL;
+}
+
+static void
+pool_work(struct pool_worker *w)
+{
+	int task;
+
+	for (;;) {
+		while ((task = pool_take(w)) != -1)
+			w->pool->fn(w->pool->arg, task);
+
+		/*
+		 * Anything still unclaimed belongs to a thread that's running
+		 * and will get to it, so there's no need to wait around
+		 */
+		if (!pool_steal(w))
+			return;
+	}
+}
+
+/* the next task from the front of our own range, or -1 if it's empty */
+static int
+pool_take(struct pool_worker *w)
+{
+	uint64_t r;
+
+	r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+	do {
+		if (RANGE_LO(r) >= RANGE_HI(r))
+			return -1;
+	} while (!__atomic_compare_exchange_n(&w->range, &r,
+	    RANGE(RANGE_LO(r) + 1, RANGE_HI(r)), 0, __ATOMIC_ACQ_REL,
+	    __ATOMIC_ACQUIRE));
+
+	return RANGE_LO(r);
+}
+
+/*
+ * Move the back half of the biggest range left to our own empty one,
+ * returning 0 if there was nothing left to take
+ */
+static int
+pool_steal(struct pool_worker *w)
+{
+	struct pool *pool = w->pool;
+	struct pool_worker *victim;
+	uint64_t r, best_r;
+	uint32_t lo, hi, mid;
+	int i;
+
+	for (;;) {
+		victim = NULL;
+		best_r = 0;
+		for (i = 0; i < pool->nworkers; i++) {
+			if (&pool->workers[i] == w)
+				continue;
+			r = __atomic_load_n(&pool->workers[i].range,
+			    __ATOMIC_ACQUIRE);
+			if (RANGE_LO(r) >= RANGE_HI(r))
+				continue;
+			if (victim == NULL || RANGE_HI(r) - RANGE_LO(r) >
+			    RANGE_HI(best_r) - RANGE_LO(best_r)) {
+				victim = &pool->workers[i];
+				best_r = r;
+			}
+		}
+		if (victim == NULL)
+			return 0;
+
+		/* with one task left, it's taken whole */
+		lo = RANGE_LO(best_r);
+		hi = RANGE_HI(best_r);
+		mid = lo + (hi - lo) / 2;
+		if (__atomic_compare_exchange_n(&victim->range, &best_r,
+		    RANGE(lo, mid), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&w->range, RANGE(mid, hi),
+			    __ATOMIC_RELEASE);
+			return 1;
+		}
+		/* it took one or lost some to another thief, so look again */
+	}
+}
@@ -0,0 +1,990 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <err.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+#include "pdjson.h"
+#include "provider.h"
+#include "alloc.h"
+
+/*
+ * Current conditions can come from any of a list of providers, each with its
+ * own URL and response format but all producing the same struct observation,
+ * with openweathermap condition ids since that is what everything else
+ * understands.  Each fetch goes to the provider that has been answering the
+ * fastest, skipping any that have recently failed, and if it fails, the next
+ * one is tried right away so the display never goes without.  Every so often
+ * the least recently used one is tried instead, to keep the measurements of
+ * the others current.
+ */
+
+#if TLS
+#define SCHEME		"https://"
+#else
+#define SCHEME		"http://"
+#endif
+
+#define MAX_DEPTH	4
+
+static int	owm_parse(struct provider *p, struct http_request *req,
+		    struct observation *obs);
+static int	openmeteo_parse(struct provider *p, struct http_request *req,
+		    struct observation *obs);
+static int	nws_parse(struct provider *p, struct http_request *req,
+		    struct observation *obs);
+static int	metar_parse(struct provider *p, struct http_request *req,
+		    struct observation *obs);
+static int	owm_read(void *cookie);
+static int	owm_peek(void *cookie);
+static int	metar_temp(const char *tok, int *temp, int *dew);
+static int	metar_weather(const char *tok);
+static void	describe(struct observation *obs);
+static int	provider_pick(unsigned int tried);
+static int	provider_try(struct provider *p, struct observation *obs);
+
+static const struct {
+	const char *name;
+	int (*parse)(struct provider *, struct http_request *,
+	    struct observation *);
+	int local;
+	const char *base;
+} provider_types[] = {
+	{ "owm", owm_parse, 0, NULL },
+	{ "open-meteo", openmeteo_parse, 0, SCHEME "api.open-meteo.com" },
+	{ "nws", nws_parse, 0, "https://api.weather.gov" },
+	{ "metar", metar_parse, 1, NULL },
+};
+
+/* https://openweathermap.org/weather-conditions */
+static const struct {
+	int id;
+	const char *description;
+} conditions[] = {
+	{ 201, "Thunderstorm with rain" },
+	{ 211, "Thunderstorm" },
+	{ 300, "Light drizzle" },
+	{ 301, "Drizzle" },
+	{ 302, "Heavy drizzle" },
+	{ 311, "Freezing drizzle" },
+	{ 500, "Light rain" },
+	{ 501, "Moderate rain" },
+	{ 502, "Heavy rain" },
+	{ 511, "Freezing rain" },
+	{ 520, "Light rain showers" },
+	{ 521, "Rain showers" },
+	{ 522, "Heavy rain showers" },
+	{ 600, "Light snow" },
+	{ 601, "Snow" },
+	{ 602, "Heavy snow" },
+	{ 611, "Sleet" },
+	{ 616, "Rain and snow" },
+	{ 621, "Snow showers" },
+	{ 622, "Heavy snow showers" },
+	{ 701, "Mist" },
+	{ 711, "Smoke" },
+	{ 721, "Haze" },
+	{ 741, "Fog" },
+	{ 761, "Dust" },
+	{ 781, "Tornado" },
+	{ 800, "Clear sky" },
+	{ 801, "Few clouds" },
+	{ 802, "Scattered clouds" },
+	{ 803, "Broken clouds" },
+	{ 804, "Overcast clouds" },
+};
+
+/* https://open-meteo.com/en/docs, WMO weather interpretation codes */
+static const struct {
+	int wmo;
+	int id;
+} wmo_codes[] = {
+	{ 0, 800 }, { 1, 801 }, { 2, 802 }, { 3, 804 },
+	{ 45, 741 }, { 48, 741 },
+	{ 51, 300 }, { 53, 301 }, { 55, 302 }, { 56, 311 }, { 57, 311 },
+	{ 61, 500 }, { 63, 501 }, { 65, 502 }, { 66, 511 }, { 67, 511 },
+	{ 71, 600 }, { 73, 601 }, { 75, 602 }, { 77, 600 },
+	{ 80, 520 }, { 81, 521 }, { 82, 522 }, { 85, 621 }, { 86, 622 },
+	{ 95, 211 }, { 96, 201 }, { 99, 201 },
+};
+
+/* https://api.weather.gov/icons, first prefix match wins */
+static const struct {
+	const char *icon;
+	int id;
+} nws_icons[] = {
+	{ "tsra", 211 },
+	{ "tornado", 781 },
+	{ "hurricane", 781 },
+	{ "tropical_storm", 781 },
+	{ "rain_showers", 521 },
+	{ "rain_snow", 616 },
+	{ "rain_sleet", 611 },
+	{ "rain_fzra", 511 },
+	{ "rain", 500 },
+	{ "snow_sleet", 611 },
+	{ "snow_fzra", 511 },
+	{ "snow", 601 },
+	{ "blizzard", 602 },
+	{ "sleet", 611 },
+	{ "fzra", 511 },
+	{ "fog", 741 },
+	{ "haze", 721 },
+	{ "smoke", 711 },
+	{ "dust", 761 },
+	{ "skc", 800 },
+	{ "few", 801 },
+	{ "sct", 802 },
+	{ "bkn", 803 },
+	{ "ovc", 804 },
+	{ "hot", 800 },
+	{ "cold", 800 },
+};
+
+static struct provider providers[PROVIDER_MAX];
+static int nproviders = 0;
+static int nfetches = 0;
+static int fahrenheit = 1;
+static struct http_request *prewarm_req = NULL;
+static int prewarm_provider = -1;
+
+/* name[:arg][@base url] */
+int
+provider_add(const char *spec)
+{
+	struct provider *p;
+	const char *arg, *base;
+	size_t len;
+	int i;
+
+	if (nproviders == PROVIDER_MAX)
+		errx(1, "too many providers, at most %d", PROVIDER_MAX);
+
+	base = strstr(spec, "@http");
+	arg = strchr(spec, ':');
+	if (arg != NULL && base != NULL && arg > base)
+		arg = NULL;
+	len = (arg ? arg : (base ? base : spec + strlen(spec))) - spec;
+
+	for (i = 0; i < sizeof(provider_types) / sizeof(provider_types[0]);
+	    i++) {
+		if (strlen(provider_types[i].name) == len &&
+		    strncmp(spec, provider_types[i].name, len) == 0)
+			break;
+	}
+	if (i == sizeof(provider_types) / sizeof(provider_types[0]))
+		return -1;
+
+	p = &providers[nproviders++];
+	memset(p, 0, sizeof(struct provider));
+	p->name = provider_types[i].name;
+	p->parse = provider_types[i].parse;
+	p->local = provider_types[i].local;
+
+	if (arg != NULL) {
+		arg++;
+		len = (base ? base : arg + strlen(arg)) - arg;
+		if ((p->arg = strndup(arg, len)) == NULL)
+			err(1, "strndup");
+	}
+	if (base != NULL) {
+		if ((p->base = strdup(base + 1)) == NULL)
+			err(1, "strdup");
+		len = strlen(p->base);
+		if (len && p->base[len - 1] == '/')
+			p->base[len - 1] = '\0';
+	} else if (provider_types[i].base != NULL)
+		p->base = (char *)provider_types[i].base;
+
+	if (p->arg == NULL && strcmp(p->name, "owm") != 0)
+		errx(1, "provider %s needs an argument", p->name);
+
+	return 0;
+}
+
+/* build each provider's url, once all options are known */
+void
+provider_setup(const char *api_base, const char *api_key,
+    const char *zipcode, int use_fahrenheit)
+{
+	struct provider *p;
+	char *comma;
+	int i, ret = 0;
+
+	fahrenheit = use_fahrenheit;
+
+	if (nproviders == 0)
+		provider_add("owm");
+
+	for (i = 0; i < nproviders; i++) {
+		p = &providers[i];
+
+		if (strcmp(p->name, "owm") == 0 && api_key == NULL)
+			/* only replaying */
+			continue;
+		else if (strcmp(p->name, "owm") == 0)
+			ret = asprintf(&p->url, "%s/data/2.5/"
+			    "weather?zip=%s&appid=%s&units=%s&mode=json",
+			    p->base ? p->base : api_base,
+			    p->arg ? p->arg : zipcode, api_key,
+			    fahrenheit ? "imperial" : "metric");
+		else if (strcmp(p->name, "open-meteo") == 0) {
+			if ((comma = strchr(p->arg, ',')) == NULL)
+				errx(1, "open-meteo needs latitude,longitude");
+			ret = asprintf(&p->url, "%s/v1/forecast?"
+			    "latitude=%.*s&longitude=%s&current=temperature_2m,"
+			    "relative_humidity_2m,surface_pressure,"
+			    "weather_code,is_day&temperature_unit=%s",
+			    p->base, (int)(comma - p->arg), p->arg, comma + 1,
+			    fahrenheit ? "fahrenheit" : "celsius");
+		} else if (strcmp(p->name, "nws") == 0)
+			ret = asprintf(&p->url,
+			    "%s/stations/%s/observations/latest", p->base,
+			    p->arg);
+		else if ((p->url = strdup(p->arg)) == NULL)
+			err(1, "strdup");
+
+		if (ret == -1)
+			err(1, "asprintf");
+	}
+}
+
+int
+provider_count(void)
+{
+	return nproviders;
+}
+
+/* whether any provider needs an openweathermap API key and zipcode */
+int
+provider_wants_key(void)
+{
+	int i;
+
+	if (nproviders == 0)
+		return 1;
+
+	for (i = 0; i < nproviders; i++) {
+		if (strcmp(providers[i].name, "owm") == 0 &&
+		    providers[i].arg == NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* something identifying the location, for keying the cache */
+const char *
+provider_location(void)
+{
+	if (nproviders == 0 || providers[0].arg == NULL)
+		return NULL;
+
+	return providers[0].arg;
+}
+
+int
+provider_fetch(struct observation *obs)
+{
+	unsigned int tried = 0;
+	int i;
+
+	while ((i = provider_pick(tried)) != -1) {
+		tried |= (1 << i);
+		if (provider_try(&providers[i], obs) == 0) {
+			nfetches++;
+			return 0;
+		}
+	}
+
+	nfetches++;
+	return -1;
+}
+
+/*
+ * Parse a recorded response, or one fetched from a URL, as if it came from
+ * the first provider.  req is the response if it has already been fetched.
+ */
+int
+provider_replay(const char *path, struct http_request *req,
+    struct observation *obs)
+{
+	struct provider *p = &providers[0];
+	int ret;
+
+	/* or fetched anew each time, to time a server and the way to it */
+	if (req == NULL && strstr(path, "://") != NULL)
+		req = http_get(path);
+	else if (req == NULL)
+		req = http_file_open(path);
+	if (req == NULL)
+		return -1;
+
+	if (!p->local && http_req_skip_header(req) != 1) {
+		warnx("failed reading HTTP body");
+		http_req_free(req);
+		return -1;
+	}
+
+	memset(obs, 0, sizeof(struct observation));
+	obs->time = time(NULL);
+	ret = p->parse(p, req, obs);
+	http_req_free(req);
+
+	return (ret == 0 && obs->weather_id != 0) ? 0 : -1;
+}
+
+/* connect ahead of time to whichever provider the next fetch will use */
+void
+provider_prewarm(void)
+{
+	int i;
+
+	if (prewarm_req != NULL)
+		return;
+
+	i = provider_pick(0);
+	if (i == -1 || providers[i].local)
+		return;
+
+	prewarm_req = http_connect(providers[i].url);
+	prewarm_provider = i;
+}
+
+void
+provider_prewarm_drop(void)
+{
+	http_req_free(prewarm_req);
+	prewarm_req = NULL;
+	prewarm_provider = -1;
+}
+
+void
+provider_report(FILE *out)
+{
+	struct provider *p;
+	int i;
+
+	for (i = 0; i < nproviders; i++) {
+		p = &providers[i];
+		fprintf(out, "%s%s%s: %d request%s, %d failed, %d ms average\n",
+		    p->name, p->arg ? " " : "", p->arg ? p->arg : "",
+		    p->requests, p->requests == 1 ? "" : "s", p->errors,
+		    p->latency_ms);
+	}
+}
+
+/*
+ * The healthy provider that has been fastest (trying any that haven't been
+ * measured yet first), or the least recently used one every so often.  If
+ * they're all down, the one due back soonest.
+ */
+static int
+provider_pick(unsigned int tried)
+{
+	struct provider *p, *best = NULL;
+	time_t now = time(NULL);
+	int i, explore;
+
+	explore = (tried == 0 && nfetches > 0 &&
+	    (nfetches % PROVIDER_EXPLORE_EVERY) == 0);
+
+	for (i = 0; i < nproviders; i++) {
+		p = &providers[i];
+		if ((tried & (1 << i)) || p->down_until > now)
+			continue;
+		if (best == NULL ||
+		    (explore && p->last_used < best->last_used) ||
+		    (!explore && p->latency_ms < best->latency_ms))
+			best = p;
+	}
+
+	if (best == NULL) {
+		for (i = 0; i < nproviders; i++) {
+			p = &providers[i];
+			if (tried & (1 << i))
+				continue;
+			if (best == NULL || p->down_until < best->down_until)
+				best = p;
+		}
+	}
+
+	return (best ? best - providers : -1);
+}
+
+static int
+provider_try(struct provider *p, struct observation *obs)
+{
+	struct http_request *req;
+	struct timespec start, end;
+	int ret = -1, ms, backoff;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	p->requests++;
+	p->last_used = time(NULL);
+
+	if (p->url == NULL)
+		req = NULL;
+	else if (p->local)
+		req = http_file_open(p->url);
+	else if (prewarm_req != NULL && prewarm_provider == p - providers) {
+		req = prewarm_req;
+		prewarm_req = NULL;
+		if (http_alive(req) && http_send(req) == 0)
+			req = http_hedge(req, p->url);
+		else {
+			http_req_free(req);
+			req = http_get(p->url);
+		}
+	} else
+		req = http_get(p->url);
+
+	if (req == NULL)
+		goto done;
+
+	if (!p->local) {
+		if (http_req_skip_header(req) != 1) {
+			warnx("%s: failed reading HTTP body", p->name);
+			goto done;
+		}
+		if (req->status != 200) {
+			warnx("%s: HTTP status %d", p->name, req->status);
+			goto done;
+		}
+	}
+
+	memset(obs, 0, sizeof(struct observation));
+	obs->time = time(NULL);
+	if (p->parse(p, req, obs) == 0 && obs->weather_id != 0)
+		ret = 0;
+	else
+		warnx("%s: failed parsing response", p->name);
+
+done:
+	http_req_free(req);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ms = ((end.tv_sec - start.tv_sec) * 1000) +
+	    ((end.tv_nsec - start.tv_nsec) / 1000000);
+	if (ms < 1)
+		ms = 1;
+
+	if (ret == 0) {
+		p->failures = 0;
+		p->down_until = 0;
+		p->latency_ms = p->latency_ms ?
+		    ((p->latency_ms * 3) + ms) / 4 : ms;
+	} else {
+		p->errors++;
+		p->failures++;
+		backoff = 60 << (p->failures > 6 ? 6 : p->failures - 1);
+		if (backoff > PROVIDER_MAX_BACKOFF)
+			backoff = PROVIDER_MAX_BACKOFF;
+		p->down_until = time(NULL) + backoff;
+	}
+
+#if DEBUG
+	printf("%s: %s in %d ms, average %d ms\n", p->name,
+	    ret == 0 ? "fetched" : "failed", ms, p->latency_ms);
+#endif
+
+	return ret;
+}
+
+static int
+owm_read(void *cookie)
+{
+	struct http_request *req = (struct http_request *)cookie;
+
+	return (int)http_req_byte_read(req);
+}
+
+static int
+owm_peek(void *cookie)
+{
+	struct http_request *req = (struct http_request *)cookie;
+
+	return (int)http_req_byte_peek(req);
+}
+
+/* https://openweathermap.org/current#parameter */
+static int
+owm_parse(struct provider *p, struct http_request *req,
+    struct observation *obs)
+{
+	json_stream js;
+	enum json_type jt;
+	const char *str = NULL;
+	enum {
+		STATE_BEGIN,
+		STATE_IN_WEATHER,
+		STATE_IN_WEATHER_ID,
+		STATE_IN_WEATHER_DESC,
+		STATE_IN_WEATHER_ICON,
+		STATE_IN_MAIN,
+		STATE_IN_MAIN_TEMP,
+		STATE_IN_MAIN_HUMIDITY,
+		STATE_IN_MAIN_PRESSURE,
+	} state = STATE_BEGIN;
+
+	json_open_user(&js, owm_read, owm_peek, req);
+	ALLOC_JSON(&js);
+	for (; jt = json_next(&js), jt != JSON_DONE && !json_get_error(&js);) {
+		if (jt == JSON_STRING)
+			str = json_get_string(&js, 0);
+
+#if DEBUG
+		printf("[%d] jt %d %s\n", state, jt,
+		    jt == JSON_STRING ? str : "");
+#endif
+
+		switch (state) {
+		case STATE_BEGIN:
+			if (jt == JSON_STRING && strcmp(str, "weather") == 0)
+				state = STATE_IN_WEATHER;
+			else if (jt == JSON_STRING && strcmp(str, "main") == 0)
+				state = STATE_IN_MAIN;
+			break;
+		case STATE_IN_WEATHER:
+			if (jt == JSON_STRING &&
+			    strcmp(str, "description") == 0)
+				state = STATE_IN_WEATHER_DESC;
+			else if (jt == JSON_STRING && strcmp(str, "id") == 0)
+				state = STATE_IN_WEATHER_ID;
+			else if (jt == JSON_STRING && strcmp(str, "icon") == 0)
+				state = STATE_IN_WEATHER_ICON;
+			else if (jt == JSON_OBJECT_END)
+				state = STATE_BEGIN;
+			break;
+		case STATE_IN_WEATHER_ID:
+			if (jt == JSON_NUMBER)
+				obs->weather_id = json_get_number(&js);
+			state = STATE_IN_WEATHER;
+			break;
+		case STATE_IN_WEATHER_ICON:
+			if (jt == JSON_STRING)
+				/* "13d" or "04n" */
+				obs->night = (str[2] == 'n');
+			state = STATE_IN_WEATHER;
+			break;
+		case STATE_IN_WEATHER_DESC:
+			strlcpy(obs->description, str,
+			    sizeof(obs->description));
+			obs->description[0] = toupper(obs->description[0]);
+			state = STATE_IN_WEATHER;
+			break;
+		case STATE_IN_MAIN:
+			if (jt == JSON_STRING && strcmp(str, "temp") == 0)
+				state = STATE_IN_MAIN_TEMP;
+			else if (jt == JSON_STRING &&
+			    strcmp(str, "humidity") == 0)
+				state = STATE_IN_MAIN_HUMIDITY;
+			else if (jt == JSON_STRING &&
+			    strcmp(str, "pressure") == 0)
+				state = STATE_IN_MAIN_PRESSURE;
+			break;
+		case STATE_IN_MAIN_TEMP:
+			if (jt == JSON_NUMBER)
+				obs->temp = json_get_number(&js);
+			state = STATE_IN_MAIN;
+			break;
+		case STATE_IN_MAIN_HUMIDITY:
+			if (jt == JSON_NUMBER)
+				obs->humidity = json_get_number(&js);
+			state = STATE_IN_MAIN;
+			break;
+		case STATE_IN_MAIN_PRESSURE:
+			if (jt == JSON_NUMBER)
+				obs->pressure = json_get_number(&js);
+			state = STATE_IN_MAIN;
+			break;
+		}
+	}
+
+	json_close(&js);
+
+#if DEBUG
+	printf("current conditions: %s\ntemperature: %d\nweather_id: %d\n",
+	    obs->description, (int)obs->temp, obs->weather_id);
+#endif
+
+	return 0;
+}
+
+/* https://open-meteo.com/en/docs, just the "current" object */
+static int
+openmeteo_parse(struct provider *p, struct http_request *req,
+    struct observation *obs)
+{
+	json_stream js;
+	enum json_type jt, ctx;
+	char keys[MAX_DEPTH + 1][24], *body;
+	size_t len, depth, count;
+	int i, ret = 0;
+
+	if ((body = http_req_body(req, &len, PROVIDER_MAX_BODY)) == NULL)
+		return -1;
+
+	memset(keys, 0, sizeof(keys));
+	json_open_buffer(&js, body, len);
+	ALLOC_JSON(&js);
+	for (; jt = json_next(&js), jt != JSON_DONE && jt != JSON_ERROR;) {
+		depth = json_get_depth(&js);
+		if (depth > MAX_DEPTH)
+			continue;
+		ctx = json_get_context(&js, &count);
+
+		if (jt == JSON_STRING && ctx == JSON_OBJECT && (count & 1)) {
+			snprintf(keys[depth], sizeof(keys[depth]), "%s",
+			    json_get_string(&js, NULL));
+			continue;
+		}
+
+		if (jt != JSON_NUMBER || depth != 2 ||
+		    strcmp(keys[1], "current") != 0)
+			continue;
+
+		if (strcmp(keys[2], "temperature_2m") == 0)
+			obs->temp = json_get_number(&js);
+		else if (strcmp(keys[2], "relative_humidity_2m") == 0)
+			obs->humidity = json_get_number(&js);
+		else if (strcmp(keys[2], "surface_pressure") == 0)
+			obs->pressure = json_get_number(&js);
+		else if (strcmp(keys[2], "is_day") == 0)
+			obs->night = (json_get_number(&js) == 0);
+		else if (strcmp(keys[2], "weather_code") == 0) {
+			for (i = 0; i < sizeof(wmo_codes) /
+			    sizeof(wmo_codes[0]); i++) {
+				if (wmo_codes[i].wmo ==
+				    (int)json_get_number(&js)) {
+					obs->weather_id = wmo_codes[i].id;
+					break;
+				}
+			}
+		}
+	}
+
+	if (json_get_error(&js)) {
+		warnx("%s: %s", p->name, json_get_error(&js));
+		ret = -1;
+	}
+	json_close(&js);
+	free(body);
+
+	describe(obs);
+
+	return ret;
+}
+
+/* https://www.weather.gov/documentation/services-web-api */
+static int
+nws_parse(struct provider *p, struct http_request *req,
+    struct observation *obs)
+{
+	json_stream js;
+	enum json_type jt, ctx;
+	char keys[MAX_DEPTH + 1][24], *body, icon[32] = "";
+	const char *str, *c;
+	size_t len, depth, count;
+	int i, have_temp = 0, ret = 0;
+
+	if ((body = http_req_body(req, &len, PROVIDER_MAX_BODY)) == NULL)
+		return -1;
+
+	memset(keys, 0, sizeof(keys));
+	json_open_buffer(&js, body, len);
+	ALLOC_JSON(&js);
+	for (; jt = json_next(&js), jt != JSON_DONE && jt != JSON_ERROR;) {
+		depth = json_get_depth(&js);
+		if (depth > MAX_DEPTH)
+			continue;
+		ctx = json_get_context(&js, &count);
+
+		if (jt == JSON_STRING && ctx == JSON_OBJECT && (count & 1)) {
+			snprintf(keys[depth], sizeof(keys[depth]), "%s",
+			    json_get_string(&js, NULL));
+			continue;
+		}
+
+		if (strcmp(keys[1], "properties") != 0)
+			continue;
+
+		if (jt == JSON_STRING && depth == 2 &&
+		    strcmp(keys[2], "textDescription") == 0)
+			strlcpy(obs->description, json_get_string(&js, NULL),
+			    sizeof(obs->description));
+		else if (jt == JSON_STRING && depth == 2 &&
+		    strcmp(keys[2], "icon") == 0) {
+			/* .../icons/land/night/rain,40/tsra?size=medium */
+			str = json_get_string(&js, NULL);
+			obs->night = (strstr(str, "/night/") != NULL);
+			if ((c = strstr(str, "/day/")) != NULL)
+				c += 5;
+			else if ((c = strstr(str, "/night/")) != NULL)
+				c += 7;
+			if (c != NULL)
+				snprintf(icon, sizeof(icon), "%.*s",
+				    (int)strcspn(c, ",/?"), c);
+		} else if (jt == JSON_NUMBER && depth == 3 &&
+		    strcmp(keys[3], "value") == 0) {
+			if (strcmp(keys[2], "temperature") == 0) {
+				obs->temp = json_get_number(&js);
+				if (fahrenheit)
+					obs->temp = (obs->temp * 9 / 5) + 32;
+				have_temp = 1;
+			} else if (strcmp(keys[2], "relativeHumidity") == 0)
+				obs->humidity = json_get_number(&js) + 0.5;
+			else if (strcmp(keys[2], "barometricPressure") == 0)
+				/* pascals */
+				obs->pressure = json_get_number(&js) / 100;
+		}
+	}
+
+	if (json_get_error(&js)) {
+		warnx("%s: %s", p->name, json_get_error(&js));
+		ret = -1;
+	}
+	json_close(&js);
+	free(body);
+
+	str = icon;
+	if (strncmp(str, "wind_", 5) == 0)
+		str += 5;
+	for (i = 0; i < sizeof(nws_icons) / sizeof(nws_icons[0]); i++) {
+		if (strncmp(str, nws_icons[i].icon,
+		    strlen(nws_icons[i].icon)) == 0) {
+			obs->weather_id = nws_icons[i].id;
+			break;
+		}
+	}
+
+	/* stations report no temperature from time to time */
+	if (!have_temp)
+		obs->weather_id = 0;
+
+	describe(obs);
+
+	return ret;
+}
+
+/*
+ * A METAR report in a local file, kept current by something else, such as
+ * https://tgftp.nws.noaa.gov/data/observations/metar/stations/KORD.TXT which
+ * is a timestamp line followed by the report:
+ *
+ * KORD 181651Z 27010KT 10SM -RA FEW050 BKN250 12/03 A3012 RMK AO2 ...
+ */
+static int
+metar_parse(struct provider *p, struct http_request *req,
+    struct observation *obs)
+{
+	struct tm tm;
+	time_t now;
+	char *body, *line, *last = NULL, *tok, *save;
+	size_t len;
+	int temp, dew, have_temp = 0, have_dew = 0, cover = -1, wx = 0, id;
+
+	if ((body = http_req_body(req, &len, PROVIDER_MAX_BODY)) == NULL)
+		return -1;
+
+	/* the report is the last line */
+	for (line = strtok_r(body, "\r\n", &save); line != NULL;
+	    line = strtok_r(NULL, "\r\n", &save))
+		last = line;
+	if (last == NULL) {
+		free(body);
+		return -1;
+	}
+
+	for (tok = strtok_r(last, " ", &save); tok != NULL;
+	    tok = strtok_r(NULL, " ", &save)) {
+		len = strlen(tok);
+		if (strcmp(tok, "RMK") == 0)
+			break;
+
+		if (!have_temp && (id = metar_temp(tok, &temp, &dew)) != 0) {
+			have_temp = 1;
+			have_dew = (id == 2);
+		} else if ((tok[0] == 'A' || tok[0] == 'Q') && len == 5 &&
+		    strspn(tok + 1, "0123456789") == 4) {
+			/* hundredths of an inch of mercury, or hPa */
+			obs->pressure = atoi(tok + 1);
+			if (tok[0] == 'A')
+				obs->pressure = (obs->pressure * 33.8639 / 100) +
+				    0.5;
+		} else if (strncmp(tok, "FEW", 3) == 0 && cover < 1)
+			cover = 1;
+		else if (strncmp(tok, "SCT", 3) == 0 && cover < 2)
+			cover = 2;
+		else if (strncmp(tok, "BKN", 3) == 0 && cover < 3)
+			cover = 3;
+		else if ((strncmp(tok, "OVC", 3) == 0 ||
+		    strncmp(tok, "VV", 2) == 0) && cover < 4)
+			cover = 4;
+		else if ((strcmp(tok, "CLR") == 0 || strcmp(tok, "SKC") == 0 ||
+		    strcmp(tok, "NSC") == 0 || strcmp(tok, "NCD") == 0 ||
+		    strcmp(tok, "CAVOK") == 0) && cover < 0)
+			cover = 0;
+		else if (!wx)
+			wx = metar_weather(tok);
+	}
+	free(body);
+
+	if (!have_temp || (cover == -1 && !wx))
+		return -1;
+
+	obs->temp = temp;
+	if (have_dew)
+		/* magnus formula */
+		obs->humidity = (100 * exp((17.625 * dew) / (243.04 + dew)) /
+		    exp((17.625 * temp) / (243.04 + temp))) + 0.5;
+	if (fahrenheit)
+		obs->temp = (obs->temp * 9 / 5) + 32;
+
+	obs->weather_id = wx ? wx : 800 + (cover > 0 ? cover : 0);
+
+	/* the report doesn't say, so go by the local time */
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	obs->night = (tm.tm_hour < 6 || tm.tm_hour >= 18);
+
+	describe(obs);
+
+	return 0;
+}
+
+/* 12/03 or M02/M05, or 12/ with no dew point; 2 if both were found */
+static int
+metar_temp(const char *tok, int *temp, int *dew)
+{
+	const char *s = tok;
+	int v[2], i, neg;
+
+	for (i = 0; i < 2; i++) {
+		neg = (*s == 'M');
+		if (neg)
+			s++;
+		if (!isdigit((unsigned char)s[0]) ||
+		    !isdigit((unsigned char)s[1]))
+			return 0;
+		v[i] = ((s[0] - '0') * 10) + (s[1] - '0');
+		if (neg)
+			v[i] = -v[i];
+		s += 2;
+
+		if (i == 0) {
+			if (*s++ != '/')
+				return 0;
+			if (*s == '\0') {
+				*temp = v[0];
+				return 1;
+			}
+		}
+	}
+	if (*s != '\0')
+		return 0;
+
+	*temp = v[0];
+	*dew = v[1];
+	return 2;
+}
+
+/* a present weather group such as -RA, +TSRA or FZDZ, as a condition id */
+static int
+metar_weather(const char *tok)
+{
+	static const char *codes[] = { "MI", "PR", "BC", "DR", "BL", "SH",
+	    "TS", "FZ", "DZ", "RA", "SN", "SG", "IC", "PL", "GR", "GS", "UP",
+	    "BR", "FG", "FU", "VA", "DU", "SA", "HZ", "PY", "PO", "SQ", "FC",
+	    "SS", "DS" };
+	const char *s = tok;
+	int i, intensity = 1;
+
+	if (*s == '-') {
+		intensity = 0;
+		s++;
+	} else if (*s == '+') {
+		intensity = 2;
+		s++;
+	} else if (strncmp(s, "VC", 2) == 0)
+		/* only in the vicinity */
+		return 0;
+
+	if (*s == '\0' || strlen(s) % 2 != 0)
+		return 0;
+	for (tok = s; *tok != '\0'; tok += 2) {
+		for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+			if (strncmp(tok, codes[i], 2) == 0)
+				break;
+		}
+		if (i == sizeof(codes) / sizeof(codes[0]))
+			return 0;
+	}
+
+#define HAS(c) (strstr(s, (c)) != NULL && (strstr(s, (c)) - s) % 2 == 0)
+	if (HAS("TS"))
+		return (HAS("RA") ? 201 : 211);
+	if (HAS("FZ") && (HAS("RA") || HAS("DZ")))
+		return 511;
+	if (HAS("SN") || HAS("SG"))
+		return (HAS("SH") ? 621 : 600 + intensity);
+	if (HAS("PL") || HAS("IC") || HAS("GR") || HAS("GS"))
+		return 611;
+	if (HAS("RA"))
+		return (HAS("SH") ? 520 : 500) + intensity;
+	if (HAS("DZ"))
+		return 300 + intensity;
+	if (HAS("FG"))
+		return 741;
+	if (HAS("BR"))
+		return 701;
+	if (HAS("HZ"))
+		return 721;
+	if (HAS("FU"))
+		return 711;
+	if (HAS("DU") || HAS("SA"))
+		return 761;
+	if (HAS("FC"))
+		return 781;
+#undef HAS
+
+	return 0;
+}
+
+/* fill in a description for providers that don't give one */
+static void
+describe(struct observation *obs)
+{
+	int i;
+
+	if (obs->description[0] != '\0')
+		return;
+
+	for (i = 0; i < sizeof(conditions) / sizeof(conditions[0]); i++) {
+		if (conditions[i].id == obs->weather_id) {
+			strlcpy(obs->description, conditions[i].description,
+			    sizeof(obs->description));
+			return;
+		}
+	}
+}
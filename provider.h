@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __PROVIDER_H__
+#define __PROVIDER_H__
+
+#include <stdio.h>
+
+#include "http.h"
+#include "observation.h"
+
+#define PROVIDER_MAX		8
+
+/* largest response body read from anything but openweathermap */
+#define PROVIDER_MAX_BODY	(64 * 1024)
+
+/* every this many fetches, use the least recently tried provider */
+#define PROVIDER_EXPLORE_EVERY	10
+
+/* a failing provider is skipped for up to this long */
+#define PROVIDER_MAX_BACKOFF	(60 * 60)
+
+struct provider {
+	const char *name;
+	char *arg;		/* coordinates, station, or file */
+	char *base;		/* API base url, or NULL for the default */
+	char *url;
+	int (*parse)(struct provider *, struct http_request *,
+	    struct observation *);
+	int local;		/* url is a file to read, not fetch */
+
+	/* measured */
+	int requests;
+	int errors;
+	int failures;		/* in a row */
+	int latency_ms;		/* moving average, 0 until measured */
+	time_t last_used;
+	time_t down_until;
+};
+
+int	provider_add(const char *spec);
+void	provider_setup(const char *api_base, const char *api_key,
+	    const char *zipcode, int fahrenheit);
+int	provider_count(void);
+int	provider_wants_key(void);
+const char * provider_location(void);
+int	provider_fetch(struct observation *obs);
+int	provider_replay(const char *path, struct http_request *req,
+	    struct observation *obs);
+void	provider_prewarm(void);
+void	provider_prewarm_drop(void);
+void	provider_report(FILE *out);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+
+#include "http.h"
+#include "relay.h"
+#include "alloc.h"
+
+/*
+ * A caching HTTP proxy for the API, so a LAN full of instances pointed at it
+ * with -u costs one upstream request per query per TTL.  Requests that arrive
+ * together for the same query are answered from a single upstream fetch,
+ * different queries arriving together are fetched at once, and anything
+ * arriving while those fetches are in progress waits in the listen backlog
+ * and is then answered from the cache.  Those fetches block, so a slow
+ * upstream holds up every client until it answers or times out.
+ */
+
+struct relay_entry {
+	char *key;
+	char *response;		/* complete HTTP response we send back */
+	size_t len;
+	time_t fetched;
+};
+
+struct relay_client {
+	int fd;
+	char req[1024];
+	size_t req_len;
+	char *key;		/* set once the request has been read */
+	char *out;
+	size_t out_len;
+	size_t out_off;
+	time_t active;		/* when it last sent or took anything */
+};
+
+static struct relay_entry entries[RELAY_MAX_ENTRIES];
+static int nentries = 0;
+static struct relay_client clients[RELAY_MAX_CLIENTS];
+static int nclients = 0;
+static int listen_fd = -1;
+static char *upstream_base = NULL;
+static char *socket_path = NULL;
+static int relay_ttl;
+static unsigned long hits = 0, misses = 0;
+
+static void	relay_listen_inet(const char *spec);
+static void	relay_listen_unix(const char *path);
+static void	relay_read(struct relay_client *client);
+static void	relay_write(struct relay_client *client);
+static void	relay_respond(struct relay_client *client, const char *resp,
+		    size_t len);
+static void	relay_error(struct relay_client *client, int status,
+		    const char *msg);
+static struct relay_entry * relay_lookup(const char *key);
+static void	relay_answer(const char *key, struct relay_entry *entry);
+static struct relay_entry * relay_store(const char *key,
+		    struct http_request *req);
+
+void
+relay_listen(const char *spec, const char *upstream, int ttl)
+{
+	if (spec[0] == '/')
+		relay_listen_unix(spec);
+	else
+		relay_listen_inet(spec);
+
+	/* a whole LAN, or a batch from -b, may connect at once */
+	if (listen(listen_fd, SOMAXCONN) == -1)
+		err(1, "listen");
+
+	upstream_base = strdup(upstream);
+	if (upstream_base == NULL)
+		err(1, "strdup");
+	relay_ttl = ttl;
+}
+
+static void
+relay_listen_inet(const char *spec)
+{
+	struct sockaddr_in addr;
+	char host[64];
+	const char *port;
+	int on = 1;
+#ifdef TCP_FASTOPEN
+	int qlen;
+#endif
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	/* [address:]port */
+	if ((port = strrchr(spec, ':')) != NULL) {
+		if (port - spec >= sizeof(host))
+			errx(1, "bad relay address %s", spec);
+		memcpy(host, spec, port - spec);
+		host[port - spec] = '\0';
+		port++;
+		if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+			errx(1, "bad relay address %s", host);
+	} else
+		port = spec;
+
+	if (atoi(port) < 1 || atoi(port) > 65535)
+		errx(1, "bad relay port %s", port);
+	addr.sin_port = htons(atoi(port));
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	if (listen_fd == -1)
+		err(1, "socket");
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef TCP_FASTOPEN
+	/* instances can send their request along with the SYN */
+	qlen = RELAY_MAX_CLIENTS;
+	setsockopt(listen_fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+#endif
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(1, "bind %s", spec);
+}
+
+/*
+ * Instances on the same host can reach us through a unix domain socket with
+ * an http+unix:// URL, which skips the resolver and TCP
+ */
+static void
+relay_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat sb;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlcpy(addr.sun_path, path, sizeof(addr.sun_path)) >=
+	    sizeof(addr.sun_path))
+		errx(1, "relay socket path too long: %s", path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	if (listen_fd == -1)
+		err(1, "socket");
+
+	/*
+	 * Only replace a socket left behind by a previous run that didn't get
+	 * to clean up, which nothing is listening on anymore
+	 */
+	if (lstat(path, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode))
+			errx(1, "%s exists and is not a socket", path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			err(1, "socket");
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			errx(1, "relay socket %s is already in use", path);
+		if (errno != ECONNREFUSED)
+			err(1, "connect %s", path);
+		close(fd);
+
+		if (unlink(path) == -1)
+			err(1, "unlink %s", path);
+	} else if (errno != ENOENT)
+		err(1, "%s", path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(1, "bind %s", path);
+
+	socket_path = strdup(path);
+	if (socket_path == NULL)
+		err(1, "strdup");
+}
+
+int
+relay_pollfds(struct pollfd *pfd, int max)
+{
+	int i, n = 0;
+
+	if (listen_fd == -1)
+		return 0;
+
+	/* leave the rest in the backlog until someone hangs up */
+	if (nclients < RELAY_MAX_CLIENTS && n < max) {
+		pfd[n].fd = listen_fd;
+		pfd[n].events = POLLIN;
+		pfd[n].revents = 0;
+		n++;
+	}
+
+	for (i = 0; i < nclients && n < max; i++) {
+		pfd[n].fd = clients[i].fd;
+		pfd[n].events = clients[i].out ? POLLOUT : POLLIN;
+		pfd[n].revents = 0;
+		n++;
+	}
+
+	return n;
+}
+
+int
+relay_handle(struct pollfd *pfd, int n)
+{
+	struct relay_client *client;
+	struct relay_entry *entry;
+	struct http_request *reqs[RELAY_MAX_CLIENTS];
+	char *keys[RELAY_MAX_CLIENTS], *urls[RELAY_MAX_CLIENTS];
+	time_t now;
+	int i, j, fd, nstale = 0, active = 0;
+
+	for (i = 0; i < n; i++) {
+		if (pfd[i].revents == 0)
+			continue;
+		active++;
+
+		if (pfd[i].fd == listen_fd) {
+			/* take everyone that's waiting */
+			while (nclients < RELAY_MAX_CLIENTS &&
+			    (fd = accept4(listen_fd, NULL, NULL,
+			    SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+				client = &clients[nclients++];
+				memset(client, 0, sizeof(struct relay_client));
+				client->fd = fd;
+				client->active = time(NULL);
+				relay_read(client);
+			}
+			continue;
+		}
+
+		for (j = 0; j < nclients; j++) {
+			if (clients[j].fd != pfd[i].fd)
+				continue;
+			if (clients[j].out)
+				relay_write(&clients[j]);
+			else
+				relay_read(&clients[j]);
+			break;
+		}
+	}
+
+	/*
+	 * Answer everyone with a complete request for a fresh query from the
+	 * cache, and gather up the stale or missing ones
+	 */
+	for (i = 0; i < nclients; i++) {
+		client = &clients[i];
+		if (client->key == NULL || client->out)
+			continue;
+
+		entry = relay_lookup(client->key);
+		if (entry != NULL && time(NULL) - entry->fetched < relay_ttl) {
+			hits++;
+			relay_answer(client->key, entry);
+			continue;
+		}
+
+		for (j = 0; j < nstale; j++) {
+			if (strcmp(keys[j], client->key) == 0)
+				break;
+		}
+		if (j < nstale)
+			continue;
+		keys[nstale] = client->key;
+		if (asprintf(&urls[nstale], "%s%s", upstream_base,
+		    client->key) == -1)
+			err(1, "asprintf");
+		nstale++;
+	}
+
+	/* then fetch those from upstream all at once, each only once */
+	if (nstale) {
+		misses += nstale;
+		/* responses come back with their headers */
+		http_fetch_all((const char **)urls, nstale, reqs,
+		    RELAY_MAX_BODY * 2);
+		for (j = 0; j < nstale; j++) {
+			relay_answer(keys[j], relay_store(keys[j], reqs[j]));
+			free(urls[j]);
+		}
+	}
+
+	now = time(NULL);
+	for (i = nclients - 1; i >= 0; i--) {
+		if (clients[i].fd != -1 &&
+		    now - clients[i].active >= RELAY_IDLE_SECS) {
+			close(clients[i].fd);
+			clients[i].fd = -1;
+		}
+		if (clients[i].fd != -1)
+			continue;
+		free(clients[i].key);
+		free(clients[i].out);
+		if (i != nclients - 1)
+			memcpy(&clients[i], &clients[nclients - 1],
+			    sizeof(struct relay_client));
+		nclients--;
+	}
+
+	return active;
+}
+
+/* seconds until the next idle client is due to be dropped, or -1 */
+int
+relay_timeout(void)
+{
+	time_t now = time(NULL);
+	int i, secs = -1;
+
+	for (i = 0; i < nclients; i++) {
+		if (secs == -1 ||
+		    clients[i].active + RELAY_IDLE_SECS - now < secs)
+			secs = clients[i].active + RELAY_IDLE_SECS - now;
+	}
+
+	return (secs < 0 && nclients ? 0 : secs);
+}
+
+void
+relay_close(void)
+{
+	int i;
+
+	if (listen_fd == -1)
+		return;
+
+#if DEBUG
+	printf("relay: %lu hits, %lu misses\n", hits, misses);
+#endif
+
+	for (i = 0; i < nclients; i++) {
+		close(clients[i].fd);
+		free(clients[i].key);
+		free(clients[i].out);
+	}
+	nclients = 0;
+
+	for (i = 0; i < nentries; i++) {
+		free(entries[i].key);
+		free(entries[i].response);
+	}
+	nentries = 0;
+
+	close(listen_fd);
+	listen_fd = -1;
+	if (socket_path != NULL) {
+		unlink(socket_path);
+		free(socket_path);
+		socket_path = NULL;
+	}
+	free(upstream_base);
+	upstream_base = NULL;
+}
+
+static void
+relay_read(struct relay_client *client)
+{
+	char method[8], target[sizeof(client->req)];
+	ssize_t len;
+
+	len = read(client->fd, client->req + client->req_len,
+	    sizeof(client->req) - 1 - client->req_len);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		close(client->fd);
+		client->fd = -1;
+		return;
+	}
+	client->req_len += len;
+	client->req[client->req_len] = '\0';
+	client->active = time(NULL);
+
+	if (strstr(client->req, "\r\n\r\n") == NULL &&
+	    strstr(client->req, "\n\n") == NULL) {
+		if (client->req_len == sizeof(client->req) - 1)
+			relay_error(client, 431, "Request Header Fields Too "
+			    "Large");
+		return;
+	}
+
+	if (sscanf(client->req, "%7s %1023s HTTP/", method, target) != 2) {
+		relay_error(client, 400, "Bad Request");
+		return;
+	}
+	if (strcmp(method, "GET") != 0) {
+		relay_error(client, 405, "Method Not Allowed");
+		return;
+	}
+	if (strncmp(target, "/data/2.5/", 10) != 0) {
+		relay_error(client, 404, "Not Found");
+		return;
+	}
+
+	client->key = strdup(target);
+	if (client->key == NULL)
+		err(1, "strdup");
+}
+
+static void
+relay_write(struct relay_client *client)
+{
+	ssize_t len;
+
+	len = write(client->fd, client->out + client->out_off,
+	    client->out_len - client->out_off);
+	if (len == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len > 0) {
+		client->out_off += len;
+		client->active = time(NULL);
+	}
+	if (len <= 0 || client->out_off == client->out_len) {
+		close(client->fd);
+		client->fd = -1;
+	}
+}
+
+static void
+relay_respond(struct relay_client *client, const char *resp, size_t len)
+{
+	client->out = malloc(len);
+	if (client->out == NULL)
+		err(1, "malloc");
+	memcpy(client->out, resp, len);
+	client->out_len = len;
+	client->out_off = 0;
+
+	/* most of the time this fits in the socket buffer right away */
+	relay_write(client);
+}
+
+static void
+relay_error(struct relay_client *client, int status, const char *msg)
+{
+	char resp[256];
+	int len;
+
+	len = snprintf(resp, sizeof(resp), "HTTP/1.0 %d %s\r\n"
+	    "Content-Type: text/plain\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n"
+	    "\r\n"
+	    "%s\n", status, msg, strlen(msg) + 1, msg);
+	relay_respond(client, resp, len);
+}
+
+static struct relay_entry *
+relay_lookup(const char *key)
+{
+	int i;
+
+	for (i = 0; i < nentries; i++) {
+		if (strcmp(entries[i].key, key) == 0)
+			return &entries[i];
+	}
+
+	return NULL;
+}
+
+/* answer everyone waiting on key with entry, or an error without one */
+static void
+relay_answer(const char *key, struct relay_entry *entry)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		if (clients[i].key == NULL || clients[i].out ||
+		    strcmp(clients[i].key, key) != 0)
+			continue;
+		if (entry == NULL)
+			relay_error(&clients[i], 502, "Bad Gateway");
+		else
+			relay_respond(&clients[i], entry->response,
+			    entry->len);
+	}
+}
+
+/* cache the upstream response to key fetched as req, which is freed */
+static struct relay_entry *
+relay_store(const char *key, struct http_request *req)
+{
+	struct relay_entry *entry;
+	char *body;
+	size_t len, tlen;
+	int i, status, oldest;
+
+	if (req == NULL)
+		return NULL;
+
+	if (http_req_skip_header(req) != 1) {
+		http_req_free(req);
+		return NULL;
+	}
+	status = req->status;
+	body = http_req_body(req, &len, RELAY_MAX_BODY);
+	http_req_free(req);
+	if (body == NULL || status == 0) {
+		free(body);
+		return NULL;
+	}
+
+	entry = relay_lookup(key);
+	if (entry == NULL) {
+		if (nentries < RELAY_MAX_ENTRIES)
+			entry = &entries[nentries++];
+		else {
+			/* evict whatever was fetched longest ago */
+			for (i = 1, oldest = 0; i < nentries; i++) {
+				if (entries[i].fetched <
+				    entries[oldest].fetched)
+					oldest = i;
+			}
+			entry = &entries[oldest];
+			free(entry->key);
+		}
+		entry->key = strdup(key);
+		if (entry->key == NULL)
+			err(1, "strdup");
+	} else
+		free(entry->response);
+
+	tlen = 256 + len;
+	entry->response = malloc(tlen);
+	if (entry->response == NULL)
+		err(1, "malloc");
+	entry->len = snprintf(entry->response, tlen, "HTTP/1.0 %d %s\r\n"
+	    "Content-Type: application/json; charset=utf-8\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n"
+	    "\r\n", status, status == 200 ? "OK" : "Upstream Error", len);
+	memcpy(entry->response + entry->len, body, len);
+	entry->len += len;
+	free(body);
+
+	/* don't hold on to errors, the next client gets a fresh try */
+	entry->fetched = (status == 200) ? time(NULL) : 0;
+
+	return entry;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <poll.h>
+
+#define RELAY_MAX_CLIENTS	64
+#define RELAY_MAX_ENTRIES	64
+#define RELAY_MAX_BODY		(64 * 1024)
+
+/* clients that send or take nothing for this long are hung up on */
+#define RELAY_IDLE_SECS		10
+
+void	relay_listen(const char *spec, const char *upstream, int ttl);
+int	relay_pollfds(struct pollfd *pfd, int max);
+int	relay_handle(struct pollfd *pfd, int n);
+int	relay_timeout(void);
+void	relay_close(void);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+
+/*
+ * The latest observation for each location, kept in a small shared memory
+ * segment per user so every process on the host can read it without a
+ * syscall or a lock.  Each slot is a seqlock: the writer makes its sequence
+ * odd while it updates the slot and even when done, and readers retry until
+ * they see the same even sequence before and after copying.
+ *
+ * Each slot also holds a lease that a process takes before fetching for that
+ * location, so only one process on the host does so at a time and the rest
+ * wait for its result.
+ */
+
+#define STORE_MAGIC	0x78777373	/* "xwss" */
+#define STORE_MAX_SPINS	(1 << 20)
+
+/*
+ * A lease is its holder's pid and when it expires in one word, so both change
+ * together and nobody can see a new holder with the old one's expiry
+ */
+#define LEASE(pid, until)	(((uint64_t)(uint32_t)(pid) << 32) | \
+				    (uint32_t)(until))
+#define LEASE_PID(l)		((pid_t)((l) >> 32))
+#define LEASE_UNTIL(l)		((time_t)(uint32_t)(l))
+
+enum {
+	SLOT_EMPTY = 0,
+	SLOT_CLAIMED,
+	SLOT_READY,
+};
+
+struct store_slot {
+	uint32_t state;
+	uint32_t seq;
+	char key[32];
+	struct observation obs;
+	uint64_t lease;		/* LEASE(pid, until) */
+};
+
+struct store_segment {
+	uint32_t magic;
+	uint32_t size;		/* catches layout changes between builds */
+	struct store_slot slots[STORE_SLOTS];
+};
+
+static struct store_segment *seg = NULL;
+
+static struct store_slot *	store_slot(const char *key, int create);
+
+int
+store_open(void)
+{
+	struct stat sb;
+	char name[32];
+	uint32_t magic = 0;
+	int fd;
+
+	snprintf(name, sizeof(name), "/xweathericon.%u",
+	    (unsigned int)getuid());
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -1;
+
+	/* growing to the same size from several processes is harmless */
+	if (fstat(fd, &sb) == -1 ||
+	    (sb.st_size < sizeof(struct store_segment) &&
+	    ftruncate(fd, sizeof(struct store_segment)) == -1)) {
+		close(fd);
+		return -1;
+	}
+
+	seg = mmap(NULL, sizeof(struct store_segment), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		seg = NULL;
+		return -1;
+	}
+
+	if (!__atomic_compare_exchange_n(&seg->magic, &magic, STORE_MAGIC, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && magic != STORE_MAGIC) {
+		munmap(seg, sizeof(struct store_segment));
+		seg = NULL;
+		return -1;
+	}
+	if (magic == 0)
+		__atomic_store_n(&seg->size, sizeof(struct store_segment),
+		    __ATOMIC_RELEASE);
+	else if (__atomic_load_n(&seg->size, __ATOMIC_ACQUIRE) !=
+	    sizeof(struct store_segment)) {
+		/* from a different build, leave it alone */
+		munmap(seg, sizeof(struct store_segment));
+		seg = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+store_read(const char *key, struct observation *obs)
+{
+	struct store_slot *slot;
+	uint32_t seq;
+	int spins = 0;
+
+	if ((slot = store_slot(key, 0)) == NULL)
+		return -1;
+
+	for (;;) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			/* a writer died mid-update, don't spin forever */
+			if (++spins > STORE_MAX_SPINS)
+				return -1;
+			continue;
+		}
+		memcpy(obs, &slot->obs, sizeof(struct observation));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+
+	/* nothing has been written yet */
+	if (seq == 0)
+		return -1;
+
+	obs->description[sizeof(obs->description) - 1] = '\0';
+	return 0;
+}
+
+void
+store_write(const char *key, const struct observation *obs)
+{
+	struct store_slot *slot;
+	uint32_t seq;
+
+	if ((slot = store_slot(key, 1)) == NULL)
+		return;
+
+	/*
+	 * Writers for a slot are serialized by its lease, but in case someone
+	 * writes without it, wait for the sequence to be even and claim it
+	 */
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) & ~1U;
+	} while (!__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+	    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&slot->obs, obs, sizeof(struct observation));
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Try to become the one process fetching key for up to secs, returning 1 if
+ * we got it (or there's no store to coordinate through) and 0 if another live
+ * process holds it
+ */
+int
+store_lease(const char *key, int secs)
+{
+	struct store_slot *slot;
+	pid_t holder, me = getpid();
+	uint64_t lease;
+	time_t now = time(NULL);
+
+	if ((slot = store_slot(key, 1)) == NULL)
+		return 1;
+
+	lease = __atomic_load_n(&slot->lease, __ATOMIC_ACQUIRE);
+	for (;;) {
+		holder = LEASE_PID(lease);
+		if (holder != 0 && holder != me && LEASE_UNTIL(lease) > now &&
+		    !(kill(holder, 0) == -1 && errno == ESRCH))
+			return 0;
+
+		/* ours to renew, free, expired, or its holder died */
+		if (__atomic_compare_exchange_n(&slot->lease, &lease,
+		    LEASE(me, now + secs), 0, __ATOMIC_ACQ_REL,
+		    __ATOMIC_ACQUIRE))
+			return 1;
+	}
+}
+
+void
+store_release(const char *key)
+{
+	struct store_slot *slot;
+	pid_t me = getpid();
+	uint64_t lease;
+
+	if ((slot = store_slot(key, 0)) == NULL)
+		return;
+
+	lease = __atomic_load_n(&slot->lease, __ATOMIC_ACQUIRE);
+	while (LEASE_PID(lease) == me) {
+		if (__atomic_compare_exchange_n(&slot->lease, &lease, 0, 0,
+		    __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			break;
+	}
+}
+
+/*
+ * Wait up to secs for whoever holds the lease on key to finish, returning 0
+ * with their observation if they published one
+ */
+int
+store_wait(const char *key, struct observation *obs, int secs)
+{
+	struct store_slot *slot;
+	struct timespec ts = { 0, 50 * 1000 * 1000 };
+	pid_t holder;
+	uint32_t seq;
+	int i;
+
+	if ((slot = store_slot(key, 0)) == NULL)
+		return -1;
+
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < secs * 20; i++) {
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+			break;
+		holder = LEASE_PID(__atomic_load_n(&slot->lease,
+		    __ATOMIC_ACQUIRE));
+		if (holder == 0 || (kill(holder, 0) == -1 && errno == ESRCH))
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == seq)
+		return -1;
+
+	return store_read(key, obs);
+}
+
+static struct store_slot *
+store_slot(const char *key, int create)
+{
+	struct store_slot *slot;
+	uint32_t state;
+	int i;
+
+	if (seg == NULL || key == NULL || strlen(key) >= sizeof(slot->key))
+		return NULL;
+
+	for (i = 0; i < STORE_SLOTS; i++) {
+		slot = &seg->slots[i];
+		state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		if (state == SLOT_READY && strcmp(slot->key, key) == 0)
+			return slot;
+	}
+
+	if (!create)
+		return NULL;
+
+	for (i = 0; i < STORE_SLOTS; i++) {
+		slot = &seg->slots[i];
+		state = SLOT_EMPTY;
+		if (!__atomic_compare_exchange_n(&slot->state, &state,
+		    SLOT_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			/* someone may have just added the same key */
+			while (state == SLOT_CLAIMED)
+				state = __atomic_load_n(&slot->state,
+				    __ATOMIC_ACQUIRE);
+			if (strcmp(slot->key, key) == 0)
+				return slot;
+			continue;
+		}
+
+		snprintf(slot->key, sizeof(slot->key), "%s", key);
+		__atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+		return slot;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "stream.h"
+
+/*
+ * Each new observation is pushed as one line to every subscriber, either the
+ * reader of a named pipe or any number of clients connected to a Unix socket.
+ * Nothing here ever blocks the fetch loop: a subscriber that can't keep up
+ * only ever has its oldest unsent line replaced by the newest one, and one
+ * that hasn't read anything for STREAM_MAX_STALLS observations is dropped.
+ *
+ * A named pipe is only held open while it has a reader, and closed as soon as
+ * that reader goes away, so lines never pile up in it for whoever opens it
+ * next.
+ */
+
+#define STREAM_MAX_STALLS	4
+
+struct stream_sub {
+	int fd;
+	int fifo;
+	int stalls;
+	int progressed;
+	char buf[STREAM_LINE_MAX];	/* line being sent */
+	size_t len;
+	size_t off;
+	char next[STREAM_LINE_MAX];	/* newest line, coalesced */
+	size_t next_len;
+};
+
+static struct stream_sub subs[STREAM_MAX_SUBS];
+static int nsubs = 0;
+static int listen_fd = -1;
+static char *socket_path = NULL;
+static char *fifo_path = NULL;
+static char last_line[STREAM_LINE_MAX];
+static size_t last_len = 0;
+
+static void	stream_drop(int i);
+static int	stream_fifo_open(struct stream_sub *sub);
+static void	stream_flush(struct stream_sub *sub);
+static void	stream_queue(struct stream_sub *sub, const char *line,
+		    size_t len);
+
+void
+stream_open(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat sb;
+
+	/* a subscriber going away must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (stat(path, &sb) == 0 && S_ISFIFO(sb.st_mode)) {
+		fifo_path = strdup(path);
+		if (fifo_path == NULL)
+			err(1, "strdup");
+		subs[0].fd = -1;
+		subs[0].fifo = 1;
+		nsubs = 1;
+		stream_fifo_open(&subs[0]);
+		return;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path) >=
+	    sizeof(sun.sun_path))
+		errx(1, "socket path too long: %s", path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	    0);
+	if (listen_fd == -1)
+		err(1, "socket");
+
+	/* clean up after a previous instance */
+	if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+		unlink(path);
+
+	if (bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "bind %s", path);
+	if (listen(listen_fd, 16) == -1)
+		err(1, "listen");
+
+	socket_path = strdup(path);
+	if (socket_path == NULL)
+		err(1, "strdup");
+}
+
+int
+stream_pollfds(struct pollfd *pfd, int max)
+{
+	int i, n = 0;
+
+	if (listen_fd != -1 && n < max) {
+		pfd[n].fd = listen_fd;
+		pfd[n].events = POLLIN;
+		pfd[n].revents = 0;
+		n++;
+	}
+
+	for (i = 0; i < nsubs && n < max; i++) {
+		if (subs[i].fd == -1)
+			/* a named pipe without a reader */
+			continue;
+		pfd[n].fd = subs[i].fd;
+		pfd[n].events = (subs[i].off < subs[i].len) ? POLLOUT : 0;
+		pfd[n].revents = 0;
+		n++;
+	}
+
+	return n;
+}
+
+/* returns the number of descriptors that had activity */
+int
+stream_handle(struct pollfd *pfd, int n)
+{
+	struct stream_sub *sub;
+	int i, j, fd, active = 0;
+
+	for (i = 0; i < n; i++) {
+		if (pfd[i].revents == 0)
+			continue;
+		active++;
+
+		if (pfd[i].fd == listen_fd) {
+			fd = accept4(listen_fd, NULL, NULL,
+			    SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd == -1)
+				continue;
+			if (nsubs == STREAM_MAX_SUBS) {
+				close(fd);
+				continue;
+			}
+			sub = &subs[nsubs++];
+			memset(sub, 0, sizeof(struct stream_sub));
+			sub->fd = fd;
+			/* bring them up to date right away */
+			if (last_len)
+				stream_queue(sub, last_line, last_len);
+			continue;
+		}
+
+		for (j = 0; j < nsubs; j++) {
+			if (subs[j].fd != pfd[i].fd)
+				continue;
+			if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				close(subs[j].fd);
+				subs[j].fd = -1;
+			} else
+				stream_flush(&subs[j]);
+			break;
+		}
+	}
+
+	/* compact out anyone that went away */
+	for (i = nsubs - 1; i >= 0; i--) {
+		if (subs[i].fd == -1 && !subs[i].fifo)
+			stream_drop(i);
+	}
+
+	return active;
+}
+
+void
+stream_publish(const char *line, size_t len)
+{
+	struct stream_sub *sub;
+	int i;
+
+	if (len > sizeof(last_line))
+		len = sizeof(last_line);
+	memcpy(last_line, line, len);
+	last_len = len;
+
+	for (i = 0; i < nsubs; i++) {
+		sub = &subs[i];
+
+		if (sub->fifo && stream_fifo_open(sub) != 0)
+			/* nobody to read it */
+			continue;
+
+		if (sub->off < sub->len && !sub->progressed &&
+		    ++sub->stalls >= STREAM_MAX_STALLS && !sub->fifo) {
+#if DEBUG
+			printf("stream: dropping stalled subscriber %d\n",
+			    sub->fd);
+#endif
+			close(sub->fd);
+			sub->fd = -1;
+			continue;
+		}
+
+		stream_queue(sub, line, len);
+	}
+
+	for (i = nsubs - 1; i >= 0; i--) {
+		if (subs[i].fd == -1 && !subs[i].fifo)
+			stream_drop(i);
+	}
+}
+
+void
+stream_close(void)
+{
+	int i;
+
+	for (i = 0; i < nsubs; i++) {
+		if (subs[i].fd != -1)
+			close(subs[i].fd);
+	}
+	nsubs = 0;
+	free(fifo_path);
+	fifo_path = NULL;
+
+	if (listen_fd != -1) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (socket_path != NULL) {
+		unlink(socket_path);
+		free(socket_path);
+		socket_path = NULL;
+	}
+}
+
+static void
+stream_queue(struct stream_sub *sub, const char *line, size_t len)
+{
+	if (sub->off < sub->len) {
+		/*
+		 * Still sending an older line, so the new one supersedes any
+		 * other that was waiting behind it
+		 */
+		memcpy(sub->next, line, len);
+		sub->next_len = len;
+		sub->progressed = 0;
+		return;
+	}
+
+	memcpy(sub->buf, line, len);
+	sub->len = len;
+	sub->off = 0;
+	sub->stalls = 0;
+	sub->progressed = 0;
+	stream_flush(sub);
+}
+
+static void
+stream_flush(struct stream_sub *sub)
+{
+	ssize_t ret;
+
+	while (sub->off < sub->len) {
+		if (sub->fifo)
+			ret = write(sub->fd, sub->buf + sub->off,
+			    sub->len - sub->off);
+		else
+			ret = send(sub->fd, sub->buf + sub->off,
+			    sub->len - sub->off, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR)
+				return;
+			/* the pipe's reader going away closes it too */
+			close(sub->fd);
+			sub->fd = -1;
+			return;
+		}
+
+		sub->off += ret;
+		sub->progressed = 1;
+		sub->stalls = 0;
+
+		if (sub->off == sub->len && sub->next_len) {
+			memcpy(sub->buf, sub->next, sub->next_len);
+			sub->len = sub->next_len;
+			sub->off = 0;
+			sub->next_len = 0;
+		}
+	}
+}
+
+/*
+ * Open the named pipe for writing if it isn't already, which only works while
+ * someone has it open for reading
+ */
+static int
+stream_fifo_open(struct stream_sub *sub)
+{
+	if (sub->fd != -1)
+		return 0;
+
+	sub->fd = open(fifo_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (sub->fd == -1) {
+		if (errno != ENXIO)
+			warn("failed opening %s", fifo_path);
+		return -1;
+	}
+
+	sub->len = sub->off = sub->next_len = 0;
+	sub->stalls = 0;
+	return 0;
+}
+
+static void
+stream_drop(int i)
+{
+	if (i != nsubs - 1)
+		memcpy(&subs[i], &subs[nsubs - 1], sizeof(struct stream_sub));
+	nsubs--;
+}
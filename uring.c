@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2023 joshua stein <jcs@jcs.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if URING
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "http.h"
+#include "uring.h"
+#include "alloc.h"
+
+/*
+ * An io_uring backend for http_fetch_all().  Each request is queued as a
+ * linked connect, send, and read, so a whole batch costs a handful of
+ * io_uring_enter calls instead of a connect, write, and reads apiece plus a
+ * poll for every step.  Responses are read into buffers registered with the
+ * kernel up front, one per request in flight.  This talks to the kernel
+ * directly rather than needing liburing.
+ */
+
+/* what a completion is for, kept in the low bits of its user_data */
+#define URING_CANCEL	0
+#define URING_CONNECT	1
+#define URING_SEND	2
+#define URING_READ	3
+
+/* a request in flight */
+struct uring_slot {
+	int fetch;
+	int pending;		/* operations not yet completed */
+	int finished;
+	int error;
+};
+
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int sq_entries;
+	unsigned int tail;	/* of sqes filled in but not yet published */
+	unsigned int queued;	/* and not yet submitted */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len;
+
+	char *bufs;
+	int fixed;		/* bufs are registered */
+
+	struct http_fetch *fetches;
+	struct uring_slot *slots;
+	int nslots;
+	int *free;
+	int nfree;
+};
+
+static int	uring_setup(struct uring *u, int inflight);
+static void	uring_teardown(struct uring *u);
+static struct io_uring_sqe * uring_sqe(struct uring *u, int slot, int op);
+static int	uring_enter(struct uring *u, int wait);
+static void	uring_start(struct uring *u, int fetch);
+static void	uring_send(struct uring *u, int slot);
+static void	uring_read(struct uring *u, int slot);
+static void	uring_complete(struct uring *u, struct io_uring_cqe *cqe);
+static void	uring_stalled(struct uring *u);
+
+/*
+ * Run a batch through io_uring, keeping up to concurrency requests in flight.
+ * Returns -1 without having touched the batch if io_uring isn't usable here,
+ * so the caller can fall back to poll.
+ */
+int
+uring_fetch(struct http_fetch *fetches, int n, int concurrency)
+{
+	struct uring u;
+	unsigned int head, tail;
+	int next = 0;
+
+	if (concurrency > URING_MAX_INFLIGHT)
+		concurrency = URING_MAX_INFLIGHT;
+	if (concurrency > n)
+		concurrency = n;
+	if (concurrency == 0)
+		return 0;
+
+	memset(&u, 0, sizeof(u));
+	if (uring_setup(&u, concurrency) != 0)
+		return -1;
+	u.fetches = fetches;
+
+	for (;;) {
+		for (; next < n && u.nfree > 0; next++) {
+			if (fetches[next].state == HTTP_FETCH_READY)
+				uring_start(&u, next);
+		}
+
+		if (u.nfree == u.nslots)
+			break;
+
+		if (uring_enter(&u, 1) == -1) {
+			if (errno == ETIME)
+				uring_stalled(&u);
+			else if (errno != EINTR)
+				err(1, "io_uring_enter");
+		}
+
+		head = *u.cq_head;
+		tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+			uring_complete(&u, &u.cqes[head & *u.cq_mask]);
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring_teardown(&u);
+	return 0;
+}
+
+static int
+uring_setup(struct uring *u, int inflight)
+{
+	struct io_uring_params p;
+	struct iovec *iov;
+	char *ring;
+	int i;
+
+	/* completions are only ever reaped here, by this one thread */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	u->fd = syscall(__NR_io_uring_setup, inflight * 4, &p);
+	if (u->fd == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		u->fd = syscall(__NR_io_uring_setup, inflight * 4, &p);
+	}
+	if (u->fd == -1) {
+		warn("io_uring_setup");
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		warnx("io_uring lacks timed waits, using poll");
+		close(u->fd);
+		return -1;
+	}
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len)
+			u->sq_ring_len = u->cq_ring_len;
+		u->cq_ring_len = u->sq_ring_len;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		err(1, "mmap");
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			err(1, "mmap");
+	}
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+	    IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		err(1, "mmap");
+
+	ring = u->sq_ring;
+	u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(ring + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->tail = *u->sq_tail;
+
+	ring = u->cq_ring;
+	u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	u->bufs = mmap(NULL, (size_t)inflight * URING_BUF_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->bufs == MAP_FAILED)
+		err(1, "mmap");
+
+	iov = calloc(inflight, sizeof(struct iovec));
+	if (iov == NULL)
+		err(1, "calloc");
+	for (i = 0; i < inflight; i++) {
+		iov[i].iov_base = u->bufs + ((size_t)i * URING_BUF_SIZE);
+		iov[i].iov_len = URING_BUF_SIZE;
+	}
+	/* pinning them counts against RLIMIT_MEMLOCK, so they may not fit */
+	u->fixed = (syscall(__NR_io_uring_register, u->fd,
+	    IORING_REGISTER_BUFFERS, iov, inflight) == 0);
+	free(iov);
+#if DEBUG
+	if (!u->fixed)
+		printf("couldn't register io_uring buffers: %s\n",
+		    strerror(errno));
+#endif
+
+	u->slots = calloc(inflight, sizeof(struct uring_slot));
+	u->free = calloc(inflight, sizeof(int));
+	if (u->slots == NULL || u->free == NULL)
+		err(1, "calloc");
+	u->nslots = inflight;
+	for (i = 0; i < inflight; i++)
+		u->free[u->nfree++] = inflight - 1 - i;
+
+	return 0;
+}
+
+static void
+uring_teardown(struct uring *u)
+{
+	munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_len);
+	munmap(u->sq_ring, u->sq_ring_len);
+	/* which also unregisters the buffers */
+	close(u->fd);
+	munmap(u->bufs, (size_t)u->nslots * URING_BUF_SIZE);
+	free(u->slots);
+	free(u->free);
+}
+
+/* the next free sqe, tagged for the operation op of request slot */
+static struct io_uring_sqe *
+uring_sqe(struct uring *u, int slot, int op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	/* the kernel takes everything submitted, so this makes room */
+	if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+	    u->sq_entries && uring_enter(u, 0) == -1)
+		err(1, "io_uring_enter");
+
+	idx = u->tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->user_data = ((uint64_t)slot << 2) | op;
+	u->sq_array[idx] = idx;
+	u->tail++;
+	u->queued++;
+
+	return sqe;
+}
+
+/*
+ * Submit what's been queued and, if wait, wait up to HTTP_TIMEOUT for at
+ * least one completion
+ */
+static int
+uring_enter(struct uring *u, int wait)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = HTTP_TIMEOUT;
+	ts.tv_nsec = 0;
+	arg.ts = (uintptr_t)&ts;
+
+	ret = syscall(__NR_io_uring_enter, u->fd, u->queued, wait ? 1 : 0,
+	    wait ? (IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG) : 0,
+	    wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+	if (ret > 0)
+		u->queued -= ret;
+
+	return (ret == -1 ? -1 : 0);
+}
+
+/* put a request in a free slot and queue its connect, send, and read */
+static void
+uring_start(struct uring *u, int fetch)
+{
+	struct http_fetch *f = &u->fetches[fetch];
+	struct uring_slot *slot;
+	struct io_uring_sqe *sqe;
+	int s;
+
+	/*
+	 * Blocking sockets, since io_uring tries each operation without
+	 * blocking and then waits on the socket itself; a non-blocking one
+	 * would just hand EAGAIN back to us.
+	 */
+	f->req->socket = socket(f->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC,
+	    0);
+	if (f->req->socket == -1)
+		err(1, "socket");
+	if (f->addr.ss_family == AF_INET)
+		http_tune(f->req->socket);
+
+	s = u->free[--u->nfree];
+	slot = &u->slots[s];
+	memset(slot, 0, sizeof(struct uring_slot));
+	slot->fetch = fetch;
+	f->state = HTTP_FETCH_SENDING;
+
+	sqe = uring_sqe(u, s, URING_CONNECT);
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = f->req->socket;
+	sqe->addr = (uintptr_t)&f->addr;
+	sqe->off = f->addrlen;
+	sqe->flags = IOSQE_IO_LINK;
+	slot->pending++;
+
+	uring_send(u, s);
+}
+
+/*
+ * Queue sending the request with a read linked after it.  MSG_WAITALL has
+ * the kernel keep sending until all of it is out, since a short send would
+ * otherwise complete successfully and start the read while the rest of the
+ * request was still unsent.
+ */
+static void
+uring_send(struct uring *u, int s)
+{
+	struct uring_slot *slot = &u->slots[s];
+	struct http_fetch *f = &u->fetches[slot->fetch];
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(u, s, URING_SEND);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = f->req->socket;
+	sqe->addr = (uintptr_t)f->req->message;
+	sqe->len = f->len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+	slot->pending++;
+
+	uring_read(u, s);
+}
+
+static void
+uring_read(struct uring *u, int s)
+{
+	struct uring_slot *slot = &u->slots[s];
+	struct http_fetch *f = &u->fetches[slot->fetch];
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(u, s, URING_READ);
+	sqe->fd = f->req->socket;
+	sqe->addr = (uintptr_t)(u->bufs + ((size_t)s * URING_BUF_SIZE));
+	sqe->len = URING_BUF_SIZE;
+	if (u->fixed) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = s;
+		sqe->off = (uint64_t)-1;
+	} else
+		sqe->opcode = IORING_OP_RECV;
+	slot->pending++;
+}
+
+static void
+uring_complete(struct uring *u, struct io_uring_cqe *cqe)
+{
+	struct uring_slot *slot;
+	struct http_fetch *f;
+	int s, op, res;
+
+	op = cqe->user_data & 3;
+	if (op == URING_CANCEL)
+		return;
+	s = cqe->user_data >> 2;
+	slot = &u->slots[s];
+	f = &u->fetches[slot->fetch];
+	res = cqe->res;
+	slot->pending--;
+
+	/* whatever broke a chain reports its own error */
+	if (slot->finished || res == -ECANCELED)
+		goto check;
+
+	if (res < 0) {
+		slot->error = -res;
+		slot->finished = 1;
+		goto check;
+	}
+
+	switch (op) {
+	case URING_SEND:
+		f->sent = res;
+		if (f->sent < f->len) {
+			/* only cut short by the connection failing */
+			slot->error = EPIPE;
+			slot->finished = 1;
+		} else
+			f->state = HTTP_FETCH_RECEIVING;
+		break;
+	case URING_READ:
+		if (res == 0)
+			slot->finished = 1;
+		else if (http_fetch_append(f, u->bufs +
+		    ((size_t)s * URING_BUF_SIZE), res) != 0) {
+			slot->error = EFBIG;
+			slot->finished = 1;
+		} else
+			uring_read(u, s);
+		break;
+	}
+
+check:
+	if (slot->pending > 0)
+		return;
+	if (!slot->finished)
+		slot->error = EIO;
+	http_fetch_done(f, slot->error);
+	u->free[u->nfree++] = s;
+}
+
+/*
+ * Nothing has completed in HTTP_TIMEOUT, so give up on everything in flight.
+ * Its operations complete as canceled, which frees the slots.
+ */
+static void
+uring_stalled(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	int s;
+
+	for (s = 0; s < u->nslots; s++) {
+		if (u->slots[s].pending == 0 || u->slots[s].finished)
+			continue;
+		u->slots[s].error = ETIMEDOUT;
+		u->slots[s].finished = 1;
+
+		sqe = uring_sqe(u, s, URING_CANCEL);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = u->fetches[u->slots[s].fetch].req->socket;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+		    IORING_ASYNC_CANCEL_ALL;
+	}
+}
+
+#endif
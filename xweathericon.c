@@ -16,7 +16,6 @@
  */
 
 #include <err.h>
-#include <ctype.h>
 #include <getopt.h>
 #include <poll.h>
 #include <signal.h>
@@ -34,9 +33,21 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/xpm.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/scrnsaver.h>
 
 #include "http.h"
 #include "pdjson.h"
+#include "cache.h"
+#include "stream.h"
+#include "relay.h"
+#include "mcast.h"
+#include "forecast.h"
+#include "history.h"
+#include "obslog.h"
+#include "provider.h"
+#include "pool.h"
+#include "alloc.h"
 
 #include "icons/clouds.xpm"
 #include "icons/moon.xpm"
@@ -50,6 +61,12 @@ struct {
 	Window win;
 	XWMHints hints;
 	GC gc;
+	Pixmap atlas;		/* small versions of every icon, side by side */
+	Pixmap atlas_mask;
+	Pixmap forecast;	/* rendered forecast strip */
+	Pixmap sparkline;
+	int ss_event;		/* MIT-SCREEN-SAVER event base, or -1 */
+	int dpms;
 } xinfo = { 0 };
 
 enum icon_type {
@@ -63,70 +80,276 @@ enum icon_type {
 struct icon_map_entry {
 	char **xpm;
 	enum icon_type value;
+	char *name;
 	Pixmap pm;
 	Pixmap pm_mask;
 	XpmAttributes pm_attrs;
 } icon_map[] = {
-	{ sun_xpm, ICON_SUN },
-	{ clouds_xpm, ICON_CLOUDS },
-	{ moon_xpm, ICON_MOON },
-	{ rain_xpm, ICON_RAIN },
-	{ snow_xpm, ICON_SNOW },
+	{ sun_xpm, ICON_SUN, "sun" },
+	{ clouds_xpm, ICON_CLOUDS, "clouds" },
+	{ moon_xpm, ICON_MOON, "moon" },
+	{ rain_xpm, ICON_RAIN, "rain" },
+	{ snow_xpm, ICON_SNOW, "snow" },
 };
 
 extern char *__progname;
 
 void	killer(int);
 void	usage(void);
+void	setup_x(char *display);
+void	teardown_x(void);
 void	redraw_icon(void);
-int	fetch_weather_read(void *cookie);
-int	fetch_weather_peek(void *cookie);
 int	fetch_weather(void);
+void	prefetch_replays(void);
+void	parse_replays(void);
+void	replay_forecasts(void);
+void	parse_replay(void *arg, int i);
+void	update_conditions(void);
+enum icon_type condition_icon(int weather_id, int night);
+void	check_forecast(void);
+char *	forecast_url(void);
+void	start_forecast(void);
+double	interpolated_temp(void);
+void	track_interpolation(const struct observation *prev,
+	    const struct observation *obs);
+int	fetch_interval(void);
+void	adapt_interval(void);
+int	user_away(void);
+void	schedule_fetch(void);
+double	host_phase(void);
+void	prewarm(void);
+void	build_atlas(void);
+void	render_forecast(void);
+void	update_sparkline(void);
+void	set_observation(const struct observation *obs);
+void	heard_observation(const struct observation *obs);
+void	print_weather(const char *format);
+void	print_weather_json(void);
+size_t	weather_json(char *buf, size_t len);
 
 int	exit_msg[2];
 int	weather_check_secs = (60 * 30);
 struct timespec last_weather_check;
+int	fetch_due;		/* secs after last_weather_check */
+int	prewarm_secs = 0;
+int	prewarmed = 0;
+int	http2 = 0;
 
 char	*api_key = NULL;
 char	*zipcode = NULL;
 int	fahrenheit = 1;
 
+char	**replay_files = NULL;
+int	nreplay_files = 0;
+char	*replay_file = NULL;
+struct http_request **replay_reqs = NULL;
+struct http_request *replay_req = NULL;
+char	**forecast_files = NULL;
+int	nforecast_files = 0;
+int	batch = 0;
+int	parse_threads = 0;
+struct observation *replay_obs = NULL;
+int	*replay_rets = NULL;
+int	replay_index = 0;
+
+char	*cache_key = NULL;
+int	print_only = 0;
+char	*print_format = NULL;
+int	print_json = 0;
+int	headless = 0;
+char	*stream_path = NULL;
+char	*relay_spec = NULL;
+char	*mcast_spec = NULL;
+
+#if TLS
+char	*api_base = "https://api.openweathermap.org";
+#else
+char	*api_base = "http://api.openweathermap.org";
+#endif
+
+int	show_forecast = 0;
+int	show_history = 0;
+int	query_days = 0;
+struct forecast current_forecast;
+
+int	interpolate = 0;
+int	interp_stretch = 1;
+double	interp_error = -1;
+
+int	adaptive = 0;
+int	adaptive_min, adaptive_max, adaptive_secs;
+int	api_calls = 0;
+
+int	pause_idle = -1;
+int	paused = 0;
+
+struct observation current_obs;
 char	current_conditions[100];
 double	current_temp;
 enum icon_type current_condition_icon;
 
 #define WINDOW_WIDTH		200
 #define WINDOW_HEIGHT		100
+#define FORECAST_HEIGHT		40
+#define ICON_SMALL		16
+#define SPARK_HEIGHT		14
+#define SPARK_STEP		4
+
+/* how often to move an interpolated temperature along */
+#define INTERP_UPDATE_SECS	(60 * 5)
+/* how far to stretch the interval while the forecast is on track */
+#define INTERP_MAX_STRETCH	4
+
+/* how often to check whether the user is back, when nothing tells us */
+#define PAUSE_CHECK_SECS	60
+
+/* at most this much random jitter either way, on top of the host's phase */
+#define JITTER_MAX_SECS		30
 
 int
 main(int argc, char* argv[])
 {
 	XEvent event;
-	XSizeHints *hints;
-	XGCValues gcv;
-	struct pollfd pfd[2];
+	struct pollfd pfd[2 + 1 + STREAM_MAX_SUBS + 1 + RELAY_MAX_CLIENTS + 1];
+	struct observation obs;
 	struct sigaction act;
-	struct timespec now, delta;
+	struct timespec now, delta, start;
+	const char *location;
 	char *display = NULL;
 	long sleep_secs;
-	int ch, i;
+	char *colon;
+	int ch, i, ret, npfd, nspfd, nrpfd, active, concurrency;
 
-	while ((ch = getopt(argc, argv, "cd:i:k:z:")) != -1) {
+	while ((ch = getopt(argc, argv,
+	    "2A:b:cd:e:Ff:HIi:jk:l:m:no:P:pq:R:r:s:T:t:u:w:z:")) != -1) {
 		switch (ch) {
+		case '2':
+			http2 = 1;
+			http_h2(1);
+			break;
+		case 'A':
+			if (sscanf(optarg, "%d:%d", &adaptive_min,
+			    &adaptive_max) != 2 || adaptive_min < 1 ||
+			    adaptive_max < adaptive_min)
+				errx(1, "invalid adaptive interval range %s",
+				    optarg);
+			adaptive = 1;
+			break;
+		case 'b':
+			concurrency = HTTP_FETCH_CONCURRENCY;
+			if ((colon = strchr(optarg, ':')) != NULL) {
+				*colon = '\0';
+				concurrency = atoi(colon + 1);
+			}
+			if (http_fetch_backend(optarg, concurrency) != 0)
+				errx(1, "unsupported fetch backend %s:%d",
+				    optarg, concurrency);
+			batch = 1;
+			break;
 		case 'c':
 			fahrenheit = 0;
 			break;
+		case 'e':
+			i = atoi(optarg);
+			if (i < 1 || i > 100)
+				errx(1, "hedging percentile must be 1-100");
+			http_hedge_percentile(i);
+			break;
+		case 'F':
+			show_forecast = 1;
+			break;
+		case 'H':
+			show_history = 1;
+			break;
+		case 'I':
+			interpolate = 1;
+			break;
 		case 'd':
 			display = optarg;
 			break;
+		case 'f':
+			print_format = optarg;
+			print_only = 1;
+			break;
 		case 'i':
 			weather_check_secs = atoi(optarg);
 			if (weather_check_secs < 1)
 				errx(1, "interval must be >= 1");
 			break;
+		case 'j':
+			print_json = 1;
+			print_only = 1;
+			break;
 		case 'k':
 			api_key = strdup(optarg);
 			break;
+		case 'l':
+			relay_spec = optarg;
+			break;
+		case 'm':
+			mcast_spec = optarg;
+			break;
+		case 'n':
+			headless = 1;
+			break;
+		case 'o':
+			if (provider_add(optarg) != 0)
+				errx(1, "unknown provider %s", optarg);
+			break;
+		case 'P':
+			pause_idle = atoi(optarg);
+			if (pause_idle < 0)
+				errx(1, "idle time must be >= 0");
+			break;
+		case 'p':
+			print_only = 1;
+			break;
+		case 'q':
+			query_days = atoi(optarg);
+			if (query_days < 1)
+				errx(1, "days must be >= 1");
+			break;
+		case 'R':
+			forecast_files = reallocarray(forecast_files,
+			    nforecast_files + 1, sizeof(char *));
+			if (forecast_files == NULL)
+				err(1, "reallocarray");
+			forecast_files[nforecast_files++] = optarg;
+			break;
+		case 'r':
+			replay_files = reallocarray(replay_files,
+			    nreplay_files + 1, sizeof(char *));
+			if (replay_files == NULL)
+				err(1, "reallocarray");
+			replay_files[nreplay_files++] = optarg;
+			break;
+		case 's':
+			stream_path = optarg;
+			break;
+		case 'T':
+			parse_threads = atoi(optarg);
+			if (parse_threads == 0)
+				parse_threads = pool_cpus();
+			if (parse_threads < 1)
+				errx(1, "threads must be >= 0");
+			forecast_parse_threads(parse_threads);
+			break;
+		case 't':
+			if (http_tls_profile(optarg) != 0)
+				errx(1, "unknown TLS profile %s", optarg);
+			break;
+		case 'u':
+			api_base = optarg;
+			/* we append our own path */
+			if (api_base[0] != '\0' &&
+			    api_base[strlen(api_base) - 1] == '/')
+				api_base[strlen(api_base) - 1] = '\0';
+			break;
+		case 'w':
+			prewarm_secs = atoi(optarg);
+			if (prewarm_secs < 0)
+				errx(1, "prewarm time must be >= 0");
+			break;
 		case 'z':
 			zipcode = strdup(optarg);
 			break;
@@ -137,16 +360,72 @@ main(int argc, char* argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (api_key == NULL)
-		errx(1, "must supply openweathermap.org API key with -k");
-	if (zipcode == NULL)
-		errx(1, "must supply zipcode with -z");
+	if (adaptive) {
+		adaptive_secs = weather_check_secs;
+		if (adaptive_secs < adaptive_min)
+			adaptive_secs = adaptive_min;
+		if (adaptive_secs > adaptive_max)
+			adaptive_secs = adaptive_max;
+	}
 
-	if (!(xinfo.dpy = XOpenDisplay(display)))
-		errx(1, "can't open display %s", XDisplayName(display));
+	location = (zipcode != NULL ? zipcode : provider_location());
+
+	if (query_days) {
+		/* only reading the history log */
+		if (location == NULL)
+			errx(1, "must supply zipcode with -z");
+	} else if (relay_spec != NULL && api_key == NULL && zipcode == NULL &&
+	    provider_count() == 0) {
+		/* just relaying for others */
+		headless = 1;
+	} else {
+		if (provider_wants_key() && !nreplay_files &&
+		    !nforecast_files) {
+			if (api_key == NULL)
+				errx(1, "must supply openweathermap.org API "
+				    "key with -k");
+			if (zipcode == NULL)
+				errx(1, "must supply zipcode with -z");
+		}
+		provider_setup(api_base, api_key, zipcode, fahrenheit);
+	}
+
+	if (location != NULL) {
+		cache_open();
+		if (asprintf(&cache_key, "%s-%s", location,
+		    fahrenheit ? "imperial" : "metric") == -1)
+			err(1, "asprintf");
+	}
+
+	if (query_days)
+		return (obslog_query(cache_key,
+		    time(NULL) - (query_days * 60 * 60 * 24), stdout) != 0);
+
+	if (print_only) {
+		/* no X, just fetch (or read the cache) once and print */
+		ret = fetch_weather();
+		if (ret != 0 && cache_key != NULL &&
+		    cache_read(cache_key, &current_obs) == 0) {
+			/* stale, but better than nothing */
+			update_conditions();
+			ret = 0;
+		}
+		obslog_flush();
+		if (ret != 0)
+			return 1;
+
+		if (print_json)
+			print_weather_json();
+		else
+			print_weather(print_format ? print_format : "%d, %t%D%u");
+		return 0;
+	}
+
+	if (!headless)
+		setup_x(display);
 
 #ifdef __OpenBSD_
-	if (pledge("stdio dns inet") == -1)
+	if (pledge("stdio dns inet rpath wpath cpath flock unix") == -1)
 		err(1, "pledge");
 #endif
 
@@ -159,78 +438,157 @@ main(int argc, char* argv[])
 	sigaction(SIGINT, &act, NULL);
 	sigaction(SIGHUP, &act, NULL);
 
-	xinfo.screen = DefaultScreen(xinfo.dpy);
-	xinfo.win = XCreateSimpleWindow(xinfo.dpy,
-	    RootWindow(xinfo.dpy, xinfo.screen),
-	    0, 0, WINDOW_WIDTH, WINDOW_HEIGHT, 0,
-	    BlackPixel(xinfo.dpy, xinfo.screen),
-	    WhitePixel(xinfo.dpy, xinfo.screen));
-	gcv.foreground = 1;
-	gcv.background = 0;
-	xinfo.gc = XCreateGC(xinfo.dpy, xinfo.win, GCForeground | GCBackground,
-	    &gcv);
-	XSetFunction(xinfo.dpy, xinfo.gc, GXcopy);
+	if (stream_path != NULL)
+		stream_open(stream_path);
+	if (relay_spec != NULL)
+		relay_listen(relay_spec, api_base, weather_check_secs);
+	if (mcast_spec != NULL)
+		mcast_open(mcast_spec);
 
-	/* load XPMs */
-	for (i = 0; i < sizeof(icon_map) / sizeof(icon_map[0]); i++) {
-		if (XpmCreatePixmapFromData(xinfo.dpy,
-		    RootWindow(xinfo.dpy, xinfo.screen),
-		    icon_map[i].xpm, &icon_map[i].pm,
-		    &icon_map[i].pm_mask, &icon_map[i].pm_attrs) != 0)
-			errx(1, "XpmCreatePixmapFromData failed");
-	}
+	ALLOC_REPORT("setup");
 
-	hints = XAllocSizeHints();
-	if (!hints)
-		err(1, "XAllocSizeHints");
-	hints->flags = PMinSize | PMaxSize;
-	hints->min_width = WINDOW_WIDTH;
-	hints->min_height = WINDOW_HEIGHT;
-	hints->max_width = WINDOW_WIDTH;
-	hints->max_height = WINDOW_HEIGHT;
-#if 0	/* disabled until progman displays minimize on non-dialog wins */
-	XSetWMNormalHints(xinfo.dpy, xinfo.win, hints);
-#endif
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	fetch_weather();
+	if (nforecast_files) {
+		replay_forecasts();
+		goto done;
+	}
 
-	xinfo.hints.initial_state = IconicState;
-	xinfo.hints.flags |= StateHint;
-	XSetWMHints(xinfo.dpy, xinfo.win, &xinfo.hints);
-	XMapWindow(xinfo.dpy, xinfo.win);
+	if (nreplay_files) {
+		/*
+		 * Feed each recorded response through the same parse and
+		 * render path as a live fetch, used for PGO training and
+		 * benchmarking
+		 */
+		if (batch || parse_threads)
+			prefetch_replays();
+		if (parse_threads)
+			parse_replays();
+		for (i = 0; i < nreplay_files; i++) {
+			replay_file = replay_files[i];
+			replay_req = (replay_reqs ? replay_reqs[i] : NULL);
+			replay_index = i;
+			fetch_weather();
+			if (xinfo.dpy)
+				XSync(xinfo.dpy, False);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&now, &start, &delta);
+		printf("replayed %d response%s in %lld.%03ld ms\n",
+		    nreplay_files, nreplay_files == 1 ? "" : "s",
+		    (long long)(delta.tv_sec * 1000 + delta.tv_nsec / 1000000),
+		    (delta.tv_nsec / 1000) % 1000);
+		goto done;
+	}
+
+	if (cache_key != NULL) {
+		if (mcast_spec != NULL &&
+		    mcast_query(cache_key, &obs, MCAST_QUERY_WAIT))
+			heard_observation(&obs);
+		else {
+			start_forecast();
+			fetch_weather();
+		}
+		check_forecast();
+		schedule_fetch();
+	}
 
 	memset(&pfd, 0, sizeof(pfd));
-	pfd[0].fd = ConnectionNumber(xinfo.dpy);
+	pfd[0].fd = -1;
 	pfd[0].events = POLLIN;
 	pfd[1].fd = exit_msg[0];
 	pfd[1].events = POLLIN;
 
-	/* we need to know when we're exposed */
-	XSelectInput(xinfo.dpy, xinfo.win, ExposureMask);
+	if (xinfo.dpy) {
+		xinfo.hints.initial_state = IconicState;
+		xinfo.hints.flags |= StateHint;
+		XSetWMHints(xinfo.dpy, xinfo.win, &xinfo.hints);
+		XMapWindow(xinfo.dpy, xinfo.win);
+
+		pfd[0].fd = ConnectionNumber(xinfo.dpy);
+
+		/* we need to know when we're exposed */
+		XSelectInput(xinfo.dpy, xinfo.win, ExposureMask);
+	}
 
 	for (;;) {
-		if (!XPending(xinfo.dpy)) {
+		if (!xinfo.dpy || !XPending(xinfo.dpy)) {
 			clock_gettime(CLOCK_MONOTONIC, &now);
 			timespecsub(&now, &last_weather_check, &delta);
 
-			if (delta.tv_sec > weather_check_secs)
+			if (delta.tv_sec > fetch_due)
 				sleep_secs = 0;
 			else
-				sleep_secs = ((long)weather_check_secs -
-				    delta.tv_sec);
-
-			poll(pfd, 2, sleep_secs * 1000);
+				sleep_secs = ((long)fetch_due - delta.tv_sec);
+
+			if (prewarm_secs && !prewarmed &&
+			    sleep_secs > prewarm_secs)
+				sleep_secs -= prewarm_secs;
+
+			if (interpolate && sleep_secs > INTERP_UPDATE_SECS)
+				sleep_secs = INTERP_UPDATE_SECS;
+
+			if (paused)
+				sleep_secs = PAUSE_CHECK_SECS;
+
+			if (cache_key == NULL)
+				/* relay only, nothing to fetch for ourselves */
+				sleep_secs = -1;
+
+			/* wake up in time to drop idle relay clients */
+			i = relay_timeout();
+			if (i >= 0 && (sleep_secs < 0 || i < sleep_secs))
+				sleep_secs = i;
+
+			nspfd = stream_pollfds(pfd + 2,
+			    (sizeof(pfd) / sizeof(pfd[0])) - 2);
+			npfd = 2 + nspfd;
+			nrpfd = relay_pollfds(pfd + npfd,
+			    (sizeof(pfd) / sizeof(pfd[0])) - npfd);
+			npfd += nrpfd;
+			npfd += mcast_pollfds(pfd + npfd,
+			    (sizeof(pfd) / sizeof(pfd[0])) - npfd);
+			poll(pfd, npfd, sleep_secs < 0 ? -1 : sleep_secs * 1000);
 			if (pfd[1].revents)
 				/* exit msg */
 				break;
 
-			if (!XPending(xinfo.dpy)) {
+			active = stream_handle(pfd + 2, nspfd);
+			active += relay_handle(pfd + 2 + nspfd, nrpfd);
+			if (mcast_handle(pfd + 2 + nspfd + nrpfd,
+			    npfd - 2 - nspfd - nrpfd, cache_key, &obs)) {
+				heard_observation(&obs);
+				check_forecast();
+				schedule_fetch();
+				active++;
+			}
+
+			if (!xinfo.dpy || !XPending(xinfo.dpy)) {
+				if (cache_key == NULL)
+					continue;
 				clock_gettime(CLOCK_MONOTONIC, &now);
 				timespecsub(&now, &last_weather_check, &delta);
-				if (delta.tv_sec >= weather_check_secs)
-					fetch_weather();
-				else
-					redraw_icon();
+				if (delta.tv_sec >= fetch_due) {
+					/*
+					 * Nobody's looking, so hold off until
+					 * they're back and then fetch once
+					 */
+					paused = user_away();
+					if (!paused) {
+						start_forecast();
+						fetch_weather();
+						check_forecast();
+						schedule_fetch();
+					}
+				} else if (prewarm_secs && !prewarmed &&
+				    delta.tv_sec >= fetch_due - prewarm_secs) {
+					prewarm();
+				} else if (!active) {
+					if (interpolate)
+						update_conditions();
+					if (xinfo.dpy)
+						redraw_icon();
+				}
 				continue;
 			}
 		}
@@ -241,21 +599,148 @@ main(int argc, char* argv[])
 		case Expose:
 			redraw_icon();
 			break;
+		default:
+			if (xinfo.ss_event != -1 &&
+			    event.type == xinfo.ss_event + ScreenSaverNotify &&
+			    ((XScreenSaverNotifyEvent *)&event)->state ==
+			    ScreenSaverOff)
+				/* check again right away */
+				paused = 0;
+		}
+	}
+
+done:
+	if ((adaptive || interpolate) && cache_key != NULL && !nreplay_files) {
+		/* how many calls a fixed interval would have made */
+		clock_gettime(CLOCK_MONOTONIC, &delta);
+		timespecsub(&delta, &start, &delta);
+		printf("%d API call%s in %lld min, %lld fewer than every %d "
+		    "secs\n", api_calls, api_calls == 1 ? "" : "s",
+		    (long long)delta.tv_sec / 60,
+		    (long long)(1 + (delta.tv_sec / weather_check_secs)) -
+		    api_calls, weather_check_secs);
+	}
+	if (provider_count() > 1 && !nreplay_files)
+		provider_report(stdout);
+	if (nreplay_files || relay_spec != NULL)
+		http_report(stdout);
+
+	obslog_flush();
+	stream_close();
+	relay_close();
+	mcast_close();
+
+	if (xinfo.dpy)
+		teardown_x();
+
+	return 0;
+}
+
+void
+setup_x(char *display)
+{
+	XSizeHints *hints;
+	XGCValues gcv;
+	int i, height = WINDOW_HEIGHT;
+
+	if (!(xinfo.dpy = XOpenDisplay(display)))
+		errx(1, "can't open display %s", XDisplayName(display));
+
+	if (show_forecast)
+		height += FORECAST_HEIGHT;
+
+	xinfo.screen = DefaultScreen(xinfo.dpy);
+	xinfo.win = XCreateSimpleWindow(xinfo.dpy,
+	    RootWindow(xinfo.dpy, xinfo.screen),
+	    0, 0, WINDOW_WIDTH, height, 0,
+	    BlackPixel(xinfo.dpy, xinfo.screen),
+	    WhitePixel(xinfo.dpy, xinfo.screen));
+	gcv.foreground = 1;
+	gcv.background = 0;
+	xinfo.gc = XCreateGC(xinfo.dpy, xinfo.win, GCForeground | GCBackground,
+	    &gcv);
+	XSetFunction(xinfo.dpy, xinfo.gc, GXcopy);
+
+	/* load XPMs */
+	for (i = 0; i < sizeof(icon_map) / sizeof(icon_map[0]); i++) {
+		if (XpmCreatePixmapFromData(xinfo.dpy,
+		    RootWindow(xinfo.dpy, xinfo.screen),
+		    icon_map[i].xpm, &icon_map[i].pm,
+		    &icon_map[i].pm_mask, &icon_map[i].pm_attrs) != 0)
+			errx(1, "XpmCreatePixmapFromData failed");
+	}
+
+	if (show_forecast) {
+		build_atlas();
+		xinfo.forecast = XCreatePixmap(xinfo.dpy, xinfo.win,
+		    WINDOW_WIDTH, FORECAST_HEIGHT,
+		    DefaultDepth(xinfo.dpy, xinfo.screen));
+		render_forecast();
+	}
+
+	xinfo.ss_event = -1;
+	if (pause_idle >= 0) {
+		if (XScreenSaverQueryExtension(xinfo.dpy, &xinfo.ss_event, &i))
+			XScreenSaverSelectInput(xinfo.dpy,
+			    RootWindow(xinfo.dpy, xinfo.screen),
+			    ScreenSaverNotifyMask);
+		else {
+			warnx("no MIT-SCREEN-SAVER extension, only watching "
+			    "DPMS");
+			xinfo.ss_event = -1;
 		}
+		xinfo.dpms = DPMSQueryExtension(xinfo.dpy, &i, &i);
+	}
+
+	if (show_history) {
+		xinfo.sparkline = XCreatePixmap(xinfo.dpy, xinfo.win,
+		    WINDOW_WIDTH, SPARK_HEIGHT,
+		    DefaultDepth(xinfo.dpy, xinfo.screen));
+		XSetForeground(xinfo.dpy, xinfo.gc,
+		    WhitePixel(xinfo.dpy, xinfo.screen));
+		XFillRectangle(xinfo.dpy, xinfo.sparkline, xinfo.gc, 0, 0,
+		    WINDOW_WIDTH, SPARK_HEIGHT);
+		update_sparkline();
 	}
 
+	hints = XAllocSizeHints();
+	if (!hints)
+		err(1, "XAllocSizeHints");
+	ALLOC_COUNT(sizeof(XSizeHints));
+	hints->flags = PMinSize | PMaxSize;
+	hints->min_width = WINDOW_WIDTH;
+	hints->min_height = height;
+	hints->max_width = WINDOW_WIDTH;
+	hints->max_height = height;
+#if 0	/* disabled until progman displays minimize on non-dialog wins */
+	XSetWMNormalHints(xinfo.dpy, xinfo.win, hints);
+#endif
+	XFree(hints);
+}
+
+void
+teardown_x(void)
+{
+	int i;
+
 	for (i = 0; i < sizeof(icon_map) / sizeof(icon_map[0]); i++) {
 		if (icon_map[i].pm)
 			XFreePixmap(xinfo.dpy, icon_map[i].pm);
 		if (icon_map[i].pm_mask)
 			XFreePixmap(xinfo.dpy, icon_map[i].pm_mask);
 	}
+	if (xinfo.atlas)
+		XFreePixmap(xinfo.dpy, xinfo.atlas);
+	if (xinfo.atlas_mask)
+		XFreePixmap(xinfo.dpy, xinfo.atlas_mask);
+	if (xinfo.forecast)
+		XFreePixmap(xinfo.dpy, xinfo.forecast);
+	if (xinfo.sparkline)
+		XFreePixmap(xinfo.dpy, xinfo.sparkline);
 
 	XDestroyWindow(xinfo.dpy, xinfo.win);
-	XFree(hints);
 	XCloseDisplay(xinfo.dpy);
-
-	return 0;
+	xinfo.dpy = NULL;
 }
 
 void
@@ -272,167 +757,774 @@ void
 usage(void)
 {
 	fprintf(stderr, "usage: %s %s\n", __progname,
-		"-k api_key -z zipcode [-c] [-d display] [-i interval]");
+		"-k api_key -z zipcode [-2cFHIjnp] [-A min:max] "
+		"[-b backend[:concurrency]] [-d display] "
+		"[-e percentile] [-f format] [-i interval] [-l [address:]port] "
+		"[-m group:port] [-o provider] [-P idle] [-q days] [-R forecast] "
+		"[-r response] [-s socket] [-T threads] [-t profile] [-u url] [-w lead]");
 	exit(1);
 }
 
-int
-fetch_weather_read(void *cookie)
+/*
+ * Fetch all of the URLs given to -r at once through the -b backend, timing
+ * the whole batch by the clock and by CPU spent.  Any that fail are tried
+ * again on their own when replayed.
+ */
+void
+prefetch_replays(void)
 {
-	struct http_request *req = (struct http_request *)cookie;
+	struct timespec start, now, cpu_start, cpu, delta;
+	const char **urls;
+	int *which, i, n = 0, failed;
+
+	urls = calloc(nreplay_files, sizeof(char *));
+	which = calloc(nreplay_files, sizeof(int));
+	replay_reqs = calloc(nreplay_files, sizeof(struct http_request *));
+	if (urls == NULL || which == NULL || replay_reqs == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < nreplay_files; i++) {
+		if (strstr(replay_files[i], "://") == NULL)
+			continue;
+		which[n] = i;
+		urls[n++] = replay_files[i];
+	}
+	if (n == 0)
+		goto done;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+	/* the response is parsed as-is, so leave room for headers */
+	failed = http_fetch_all(urls, n, replay_reqs, PROVIDER_MAX_BODY * 2);
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &start, &delta);
+	timespecsub(&cpu, &cpu_start, &cpu);
+
+	printf("fetched %d of %d response%s in %lld.%03ld ms "
+	    "(%lld.%03ld ms CPU)\n", n - failed, n, n == 1 ? "" : "s",
+	    (long long)(delta.tv_sec * 1000 + delta.tv_nsec / 1000000),
+	    (delta.tv_nsec / 1000) % 1000,
+	    (long long)(cpu.tv_sec * 1000 + cpu.tv_nsec / 1000000),
+	    (cpu.tv_nsec / 1000) % 1000);
+
+	/* back in the order they were given */
+	for (i = n - 1; i >= 0; i--) {
+		replay_reqs[which[i]] = replay_reqs[i];
+		if (which[i] != i)
+			replay_reqs[i] = NULL;
+	}
 
-	return (int)http_req_byte_read(req);
+done:
+	free(urls);
+	free(which);
 }
 
-int
-fetch_weather_peek(void *cookie)
+/* parse each of the forecast responses given to -R, timing them */
+void
+replay_forecasts(void)
+{
+	struct forecast fc;
+	struct timespec start, now, delta;
+	int i, parsed = 0, steps = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nforecast_files; i++) {
+		if (forecast_replay(forecast_files[i], &fc) == 0) {
+			parsed++;
+			steps += fc.count;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &start, &delta);
+
+	printf("parsed %d of %d forecast%s (%d steps) in %lld.%03ld ms\n",
+	    parsed, nforecast_files, nforecast_files == 1 ? "" : "s", steps,
+	    (long long)(delta.tv_sec * 1000 + delta.tv_nsec / 1000000),
+	    (delta.tv_nsec / 1000) % 1000);
+}
+
+/*
+ * Parse all of the responses given to -r up front, spread across
+ * parse_threads threads.  Each lands in its own slot of replay_obs, so the
+ * threads share nothing and the replay loop picks them up in order.
+ */
+void
+parse_replays(void)
 {
-	struct http_request *req = (struct http_request *)cookie;
+	struct timespec start, now, delta;
+
+	replay_obs = calloc(nreplay_files, sizeof(struct observation));
+	replay_rets = calloc(nreplay_files, sizeof(int));
+	if (replay_obs == NULL || replay_rets == NULL)
+		err(1, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pool_run(parse_threads, nreplay_files, parse_replay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &start, &delta);
+
+	printf("parsed %d response%s on %d thread%s in %lld.%03ld ms\n",
+	    nreplay_files, nreplay_files == 1 ? "" : "s", parse_threads,
+	    parse_threads == 1 ? "" : "s",
+	    (long long)(delta.tv_sec * 1000 + delta.tv_nsec / 1000000),
+	    (delta.tv_nsec / 1000) % 1000);
+}
 
-	return (int)http_req_byte_peek(req);
+/* run on a pool thread, so nothing here may fetch or touch shared state */
+void
+parse_replay(void *arg, int i)
+{
+	struct http_request *req = replay_reqs[i];
+
+	replay_reqs[i] = NULL;
+	if (req == NULL && strstr(replay_files[i], "://") != NULL)
+		/* prefetch_replays() couldn't fetch it */
+		replay_rets[i] = -1;
+	else
+		replay_rets[i] = provider_replay(replay_files[i], req,
+		    &replay_obs[i]);
 }
 
 int
 fetch_weather(void)
 {
-	static char *url = NULL;
-	struct http_request *req;
-	json_stream js;
-	enum json_type jt;
-	const char *str;
-	int weather_id, night;
-	enum {
-		STATE_BEGIN,
-		STATE_IN_WEATHER,
-		STATE_IN_WEATHER_ID,
-		STATE_IN_WEATHER_DESC,
-		STATE_IN_WEATHER_ICON,
-		STATE_IN_MAIN,
-		STATE_IN_MAIN_TEMP,
-	} state = STATE_BEGIN;
+	struct observation obs;
+	struct timespec age;
+	int lock = -1, fresh, ret;
 
 	clock_gettime(CLOCK_MONOTONIC, &last_weather_check);
 
-	if (url == NULL) {
-		url = malloc(256);
-		if (url == NULL)
-			err(1, "malloc");
+	if (replay_file != NULL) {
+		if (replay_obs != NULL) {
+			obs = replay_obs[replay_index];
+			ret = replay_rets[replay_index];
+		} else {
+			ret = provider_replay(replay_file, replay_req, &obs);
+			replay_req = NULL;
+		}
+		if (ret != 0) {
+			memset(&obs, 0, sizeof(obs));
+			obs.time = time(NULL);
+			strlcpy(obs.description,
+			    "(Failed to parse API response)",
+			    sizeof(obs.description));
+		}
+		goto update;
+	}
 
-		snprintf(url, 256, "%s://api.openweathermap.org/data/2.5/"
-		    "weather?zip=%s&appid=%s&units=%s&mode=json",
-#if TLS
-		    "https",
-#else
-		    "http",
-#endif
-		    zipcode, api_key, fahrenheit ? "imperial" : "metric");
+	/*
+	 * If another instance (or we, in a previous life) fetched recently
+	 * enough, use that.  Otherwise take the lock and check again, since
+	 * whoever held it may have just refreshed it.
+	 */
+	if (cache_key != NULL) {
+		/* our own schedule may fetch early, see schedule_fetch */
+		fresh = (fetch_due ? fetch_due : fetch_interval());
+
+		if (cache_read(cache_key, &obs) == 0 &&
+		    time(NULL) - obs.time < fresh)
+			goto cached;
+
+		lock = cache_lock(cache_key);
+		if (cache_read(cache_key, &obs) == 0 &&
+		    time(NULL) - obs.time < fresh) {
+			cache_unlock(cache_key, lock);
+			goto cached;
+		}
 	}
 
-	req = http_get(url);
-	if (req == NULL)
-		return 1;
+	api_calls++;
+	if (provider_fetch(&obs) != 0) {
+		cache_unlock(cache_key, lock);
 
-	if (http_req_skip_header(req) != 1) {
-		warnx("failed reading HTTP body");
-		http_req_free(req);
+		/* keep showing the last one if there was one */
+		if (current_obs.weather_id != 0)
+			return 1;
+
+		memset(&obs, 0, sizeof(obs));
+		obs.time = time(NULL);
+		strlcpy(obs.description, "(Failed to parse API response)",
+		    sizeof(obs.description));
+		set_observation(&obs);
 		return 1;
 	}
 
-	snprintf(current_conditions, sizeof(current_conditions),
-	    "(Failed to parse API response)");
-	current_temp = 0;
-	weather_id = 0;
-	night = 0;
+	if (cache_key != NULL) {
+		cache_write(cache_key, &obs);
+		mcast_publish(cache_key, &obs);
+		obslog_add(cache_key, &obs);
+	}
+	cache_unlock(cache_key, lock);
+	goto update;
+
+cached:
+	/* schedule the next check relative to when it was actually fetched */
+	age.tv_sec = time(NULL) - obs.time;
+	age.tv_nsec = 0;
+	if (age.tv_sec > 0)
+		timespecsub(&last_weather_check, &age, &last_weather_check);
+
+update:
+	set_observation(&obs);
 
-	/* https://openweathermap.org/current#parameter */
-	json_open_user(&js, fetch_weather_read, fetch_weather_peek, req);
-	for (; jt = json_next(&js), jt != JSON_DONE && !json_get_error(&js);) {
-		if (jt == JSON_STRING)
-			str = json_get_string(&js, 0);
+	ALLOC_REPORT("fetch");
+
+	return 0;
+}
+
+/*
+ * Shortly before a fetch is due, resolve the API host and connect (and
+ * handshake) so that when it's time, the fetch is just the request and
+ * response
+ */
+void
+prewarm(void)
+{
+	prewarmed = 1;
+
+	if (user_away())
+		return;
+
+	provider_prewarm();
 
 #if DEBUG
-		printf("[%d] jt %d %s\n", state, jt,
-		    jt == JSON_STRING ? str : "");
+	printf("prewarmed connection for fetch in %d secs\n", prewarm_secs);
 #endif
+}
 
-		switch (state) {
-		case STATE_BEGIN:
-			if (jt == JSON_STRING && strcmp(str, "weather") == 0)
-				state = STATE_IN_WEATHER;
-			else if (jt == JSON_STRING && strcmp(str, "main") == 0)
-				state = STATE_IN_MAIN;
-			break;
-		case STATE_IN_WEATHER:
-			if (jt == JSON_STRING &&
-			    strcmp(str, "description") == 0)
-				state = STATE_IN_WEATHER_DESC;
-			else if (jt == JSON_STRING && strcmp(str, "id") == 0)
-				state = STATE_IN_WEATHER_ID;
-			else if (jt == JSON_STRING && strcmp(str, "icon") == 0)
-				state = STATE_IN_WEATHER_ICON;
-			else if (jt == JSON_OBJECT_END)
-				state = STATE_BEGIN;
-			break;
-		case STATE_IN_WEATHER_ID:
-			if (jt == JSON_NUMBER)
-				weather_id = json_get_number(&js);
-			state = STATE_IN_WEATHER;
-			break;
-		case STATE_IN_WEATHER_ICON:
-			if (jt == JSON_STRING)
-				/* "13d" or "04n" */
-				night = (str[2] == 'n');
-			state = STATE_IN_WEATHER;
-			break;
-		case STATE_IN_WEATHER_DESC:
-			strlcpy(current_conditions, str,
-			    sizeof(current_conditions));
-			current_conditions[0] = toupper(current_conditions[0]);
-			state = STATE_IN_WEATHER;
-			break;
-		case STATE_IN_MAIN:
-			if (jt == JSON_STRING && strcmp(str, "temp") == 0)
-				state = STATE_IN_MAIN_TEMP;
-			break;
-		case STATE_IN_MAIN_TEMP:
-			if (jt == JSON_NUMBER)
-				current_temp = json_get_number(&js);
-			state = STATE_IN_MAIN;
-			break;
+/* make obs current, wherever it came from */
+void
+set_observation(const struct observation *obs)
+{
+	static time_t last_seen = 0;
+	char line[STREAM_LINE_MAX];
+	size_t len;
+	int new = 0;
+
+	if (interpolate && obs->time != last_seen && obs->weather_id != 0)
+		track_interpolation(&current_obs, obs);
+
+	memcpy(&current_obs, obs, sizeof(current_obs));
+	update_conditions();
+
+	/* a cache hit may be the same observation we already have */
+	if (obs->time != last_seen) {
+		len = weather_json(line, sizeof(line));
+		stream_publish(line, len);
+		if (obs->weather_id != 0) {
+			history_add(obs);
+			if (adaptive)
+				adapt_interval();
 		}
+		last_seen = obs->time;
+		new = 1;
 	}
 
-	http_req_free(req);
+	if (xinfo.dpy) {
+		if (new && show_history)
+			update_sparkline();
+		redraw_icon();
+	}
+}
 
-#if DEBUG
-	printf("current conditions: %s\ntemperature: %d\nweather_id: %d\n",
-	    current_conditions, (int)current_temp, weather_id);
-#endif
+/*
+ * Another instance on the LAN fetched for us, so use its observation and put
+ * off our own fetch until it would have published the next one
+ */
+void
+heard_observation(const struct observation *obs)
+{
+	int logged;
+
+	/*
+	 * Whoever fetched it writes the cache before telling anyone, so if
+	 * we share its cache directory it has already logged this
+	 */
+	logged = (cache_time(cache_key) >= obs->time);
 
-	snprintf(current_conditions + strlen(current_conditions),
-	    sizeof(current_conditions) - strlen(current_conditions),
-	    "\n%d%c%c", (int)current_temp, 0xb0, /* degrees symbol */
+	set_observation(obs);
+	cache_write(cache_key, obs);
+	if (!logged)
+		obslog_add(cache_key, obs);
+
+	clock_gettime(CLOCK_MONOTONIC, &last_weather_check);
+	last_weather_check.tv_sec += mcast_grace(weather_check_secs);
+}
+
+void
+update_conditions(void)
+{
+	current_temp = interpolated_temp();
+
+	snprintf(current_conditions, sizeof(current_conditions),
+	    "%s\n%d%c%c", current_obs.description, (int)current_temp,
+	    0xb0, /* degrees symbol */
 	    fahrenheit ? 'F' : 'C');
 
+	current_condition_icon = condition_icon(current_obs.weather_id,
+	    current_obs.night);
+}
+
+enum icon_type
+condition_icon(int weather_id, int night)
+{
 	/* https://openweathermap.org/weather-conditions */
 	if (weather_id >= 200 && weather_id <= 399)
-		current_condition_icon = ICON_RAIN;
+		return ICON_RAIN;
 	else if (weather_id >= 500 && weather_id <= 599)
-		current_condition_icon = ICON_RAIN;
+		return ICON_RAIN;
 	else if (weather_id >= 600 && weather_id <= 699)
-		current_condition_icon = ICON_SNOW;
+		return ICON_SNOW;
 	else if (weather_id >= 801 && weather_id <= 804)
-		current_condition_icon = ICON_CLOUDS;
-	else {
-		if (night)
-			current_condition_icon = ICON_MOON;
+		return ICON_CLOUDS;
+	else if (night)
+		return ICON_MOON;
+	else
+		return ICON_SUN;
+}
+
+/* refetch the forecast if it's old, and redraw it if it changed */
+void
+check_forecast(void)
+{
+	struct forecast fc;
+	char *url;
+
+	if ((url = forecast_url()) == NULL)
+		return;
+
+	if (forecast_fetch(url, &fc) != 0)
+		return;
+
+	if (forecast_equal(&fc, &current_forecast)) {
+		current_forecast.fetched = fc.fetched;
+		return;
+	}
+
+	memcpy(&current_forecast, &fc, sizeof(current_forecast));
+
+	if (interpolate)
+		update_conditions();
+
+	if (xinfo.dpy) {
+		if (show_forecast)
+			render_forecast();
+		redraw_icon();
+	}
+}
+
+/* the forecast's URL if it's due to be fetched again, otherwise NULL */
+char *
+forecast_url(void)
+{
+	static char *url = NULL;
+
+	if ((!show_forecast && !interpolate) || zipcode == NULL ||
+	    api_key == NULL || replay_file != NULL)
+		return NULL;
+	if (current_forecast.fetched &&
+	    time(NULL) - current_forecast.fetched < FORECAST_CHECK_SECS)
+		return NULL;
+
+	if (url == NULL) {
+		if (asprintf(&url, "%s/data/2.5/"
+		    "forecast?zip=%s&appid=%s&units=%s&mode=json",
+		    api_base, zipcode, api_key,
+		    fahrenheit ? "imperial" : "metric") == -1)
+			err(1, "asprintf");
+	}
+
+	return url;
+}
+
+/*
+ * Send for the forecast ahead of the conditions when both are due, so that
+ * over HTTP/2 they go out together on one connection
+ */
+void
+start_forecast(void)
+{
+	char *url;
+
+	if (http2 && (url = forecast_url()) != NULL)
+		http_start(url);
+}
+
+/*
+ * The current observation moved along by however much the forecast says the
+ * temperature has changed since it was taken
+ */
+double
+interpolated_temp(void)
+{
+	double then, now;
+
+	if (!interpolate || current_obs.weather_id == 0 ||
+	    forecast_temp_at(&current_forecast, current_obs.time, &then) != 0 ||
+	    forecast_temp_at(&current_forecast, time(NULL), &now) != 0)
+		return current_obs.temp;
+
+	return current_obs.temp + (now - then);
+}
+
+/*
+ * Compare a new observation against what we would have interpolated from the
+ * previous one.  While the forecast keeps tracking reality, real fetches are
+ * spaced out further; as soon as it stops, they go back to every interval.
+ */
+void
+track_interpolation(const struct observation *prev,
+    const struct observation *obs)
+{
+	double then, now, error, good = (fahrenheit ? 1.8 : 1.0);
+
+	if (prev->weather_id == 0 ||
+	    forecast_temp_at(&current_forecast, prev->time, &then) != 0 ||
+	    forecast_temp_at(&current_forecast, obs->time, &now) != 0) {
+		interp_stretch = 1;
+		return;
+	}
+
+	error = obs->temp - (prev->temp + (now - then));
+	if (error < 0)
+		error = -error;
+
+	if (interp_error < 0)
+		interp_error = error;
+	else
+		interp_error = ((interp_error * 3) + error) / 4;
+
+	if (interp_error > good * 2)
+		interp_stretch = 1;
+	else if (interp_error > good && interp_stretch > 1)
+		interp_stretch /= 2;
+	else if (interp_error <= good && interp_stretch < INTERP_MAX_STRETCH)
+		interp_stretch *= 2;
+
+#if DEBUG
+	printf("interpolation off by %.2f (average %.2f), fetching every "
+	    "%d secs\n", error, interp_error, fetch_interval());
+#endif
+}
+
+/*
+ * Whether the screen saver is on, the display is powered down, or the user
+ * hasn't touched anything in pause_idle seconds.  Subscribers to our stream
+ * or relay are still watching though, so never pause for them.
+ */
+int
+user_away(void)
+{
+	XScreenSaverInfo *info;
+	CARD16 level;
+	BOOL enabled;
+	int away = 0;
+
+	if (pause_idle < 0 || !xinfo.dpy || stream_path != NULL ||
+	    relay_spec != NULL)
+		return 0;
+
+	if (xinfo.ss_event != -1 && (info = XScreenSaverAllocInfo()) != NULL) {
+		if (XScreenSaverQueryInfo(xinfo.dpy,
+		    RootWindow(xinfo.dpy, xinfo.screen), info)) {
+			if (info->state == ScreenSaverOn)
+				away = 1;
+			else if (pause_idle > 0 &&
+			    info->idle / 1000 >= pause_idle)
+				away = 1;
+		}
+		XFree(info);
+	}
+
+	if (!away && xinfo.dpms && DPMSInfo(xinfo.dpy, &level, &enabled) &&
+	    enabled && level != DPMSModeOn)
+		away = 1;
+
+#if DEBUG
+	if (away != paused)
+		printf("user is %s\n", away ? "away, pausing" : "back");
+#endif
+
+	return away;
+}
+
+/*
+ * Pick when the next fetch is due.  Rather than every instance fetching
+ * exactly one interval after it started, which for a fleet of machines that
+ * all boot at the same time means all fetching at once, each host fetches at
+ * its own fixed phase within the interval, moved by a little random jitter.
+ * The slot nearest to one interval from the last fetch is used, so the time
+ * between fetches stays within half an interval of what was asked for.
+ *
+ * On multicast, the group already has only one instance fetching and others
+ * time their takeover to its interval, so leave that alone.
+ */
+void
+schedule_fetch(void)
+{
+	struct timespec now;
+	time_t last, target, off;
+	int interval = fetch_interval(), jitter;
+
+	/* if the fetch didn't need it, it's too old to wait for the next one */
+	provider_prewarm_drop();
+	prewarmed = 0;
+
+	fetch_due = interval;
+	if (mcast_spec != NULL || interval < 2)
+		return;
+
+	/* wall clock time of the last fetch */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	last = time(NULL) - (now.tv_sec - last_weather_check.tv_sec);
+
+	target = last + interval;
+	off = (target - (time_t)(host_phase() * interval)) % interval;
+	if (off < 0)
+		off += interval;
+	if (off > interval / 2)
+		target += interval - off;
+	else
+		target -= off;
+
+	jitter = interval / 10;
+	if (jitter > JITTER_MAX_SECS)
+		jitter = JITTER_MAX_SECS;
+	if (jitter > 0)
+		target += (int)arc4random_uniform((jitter * 2) + 1) - jitter;
+
+	fetch_due = target - last;
+	if (fetch_due < 1)
+		fetch_due = 1;
+
+#if DEBUG
+	printf("next fetch in %d secs\n", fetch_due);
+#endif
+}
+
+/*
+ * Where in each interval this host fetches, from 0 to 1, hashed from
+ * something that differs per machine but not per run
+ */
+double
+host_phase(void)
+{
+	static double phase = -1;
+	const char *ids[] = { "/etc/machine-id", "/var/lib/dbus/machine-id" };
+	char buf[256];
+	uint64_t hash = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	ssize_t len = -1;
+	int i, fd;
+
+	if (phase >= 0)
+		return phase;
+
+	for (i = 0; i < sizeof(ids) / sizeof(ids[0]) && len <= 0; i++) {
+		if ((fd = open(ids[i], O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+		len = read(fd, buf, sizeof(buf));
+		close(fd);
+	}
+	if (len <= 0) {
+		if (gethostname(buf, sizeof(buf)) == -1)
+			buf[0] = '\0';
+		buf[sizeof(buf) - 1] = '\0';
+		len = strlen(buf);
+	}
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	phase = (hash % 10000) / 10000.0;
+	return phase;
+}
+
+/* how long to wait between real fetches */
+int
+fetch_interval(void)
+{
+	int secs;
+
+	if (!adaptive)
+		return weather_check_secs * interp_stretch;
+
+	secs = adaptive_secs * interp_stretch;
+	if (secs > adaptive_max)
+		secs = adaptive_max;
+	return secs;
+}
+
+/*
+ * Poll more often while the weather is changing and back off while it isn't,
+ * judging by the last two observations: a change of condition group (clear
+ * to rain, say) or a steep temperature slope halves the interval, while an
+ * unchanged condition and a flat temperature stretch it by half again.
+ */
+void
+adapt_interval(void)
+{
+	const struct observation *prev, *cur;
+	double slope, steep = (fahrenheit ? 3.6 : 2.0);
+	int precip_was, precip_is;
+
+	if (history_count() < 2)
+		return;
+
+	cur = history_get(0);
+	prev = history_get(1);
+	if (cur->time <= prev->time)
+		return;
+
+	/* degrees per hour */
+	slope = (cur->temp - prev->temp) * 3600 / (cur->time - prev->time);
+	if (slope < 0)
+		slope = -slope;
+
+	precip_was = (prev->weather_id >= 200 && prev->weather_id <= 699);
+	precip_is = (cur->weather_id >= 200 && cur->weather_id <= 699);
+
+	if ((precip_is && !precip_was) ||
+	    cur->weather_id / 100 != prev->weather_id / 100 || slope >= steep)
+		adaptive_secs /= 2;
+	else if (cur->weather_id == prev->weather_id && slope < steep / 4)
+		/* at least a second, or 1 would never grow again */
+		adaptive_secs += (adaptive_secs > 1 ? adaptive_secs / 2 : 1);
+
+	if (adaptive_secs < adaptive_min)
+		adaptive_secs = adaptive_min;
+	if (adaptive_secs > adaptive_max)
+		adaptive_secs = adaptive_max;
+
+#if DEBUG
+	printf("%.2f degrees/hour, fetching every %d secs\n", slope,
+	    fetch_interval());
+#endif
+}
+
+/*
+ * Print current conditions according to format, where %d is the description,
+ * %t the rounded temperature, %T the temperature with one decimal, %u the
+ * unit (F or C), %D a degree symbol, %i the condition id, %c the icon name,
+ * %h the relative humidity, %P the pressure in hPa, %a the age of the
+ * observation in seconds, and %% a literal %.
+ */
+void
+print_weather(const char *format)
+{
+	const char *f;
+	int i;
+
+	for (f = format; *f != '\0'; f++) {
+		if (*f != '%') {
+			putchar(*f);
+			continue;
+		}
+
+		switch (*++f) {
+		case 'd':
+			fputs(current_obs.description, stdout);
+			break;
+		case 't':
+			printf("%d", (int)current_temp);
+			break;
+		case 'T':
+			printf("%.1f", current_temp);
+			break;
+		case 'u':
+			putchar(fahrenheit ? 'F' : 'C');
+			break;
+		case 'D':
+			fputs("\xc2\xb0", stdout);
+			break;
+		case 'i':
+			printf("%d", current_obs.weather_id);
+			break;
+		case 'c':
+			for (i = 0; i < sizeof(icon_map) / sizeof(icon_map[0]);
+			    i++) {
+				if (icon_map[i].value ==
+				    current_condition_icon) {
+					fputs(icon_map[i].name, stdout);
+					break;
+				}
+			}
+			break;
+		case 'h':
+			printf("%d", current_obs.humidity);
+			break;
+		case 'P':
+			printf("%d", current_obs.pressure);
+			break;
+		case 'a':
+			printf("%lld", (long long)(time(NULL) -
+			    current_obs.time));
+			break;
+		case '%':
+			putchar('%');
+			break;
+		case '\0':
+			f--;
+			break;
+		default:
+			putchar('%');
+			putchar(*f);
+		}
+	}
+
+	putchar('\n');
+}
+
+void
+print_weather_json(void)
+{
+	char buf[STREAM_LINE_MAX];
+
+	weather_json(buf, sizeof(buf));
+	fputs(buf, stdout);
+}
+
+/* format current conditions as one line of JSON, newline included */
+size_t
+weather_json(char *buf, size_t len)
+{
+	char desc[sizeof(current_obs.description) * 6];
+	const char *c, *icon = "";
+	size_t n = 0;
+	int i;
+
+	for (c = current_obs.description; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') {
+			desc[n++] = '\\';
+			desc[n++] = *c;
+		} else if ((unsigned char)*c < 0x20)
+			n += snprintf(desc + n, sizeof(desc) - n, "\\u%04x",
+			    *c);
 		else
-			current_condition_icon = ICON_SUN;
+			desc[n++] = *c;
 	}
+	desc[n] = '\0';
 
-	redraw_icon();
+	for (i = 0; i < sizeof(icon_map) / sizeof(icon_map[0]); i++) {
+		if (icon_map[i].value == current_condition_icon) {
+			icon = icon_map[i].name;
+			break;
+		}
+	}
 
-	return 0;
+	n = snprintf(buf, len, "{\"description\":\"%s\",\"temp\":%.2f,"
+	    "\"units\":\"%s\",\"humidity\":%d,\"pressure\":%d,\"id\":%d,"
+	    "\"icon\":\"%s\",\"time\":%lld}\n",
+	    desc, current_temp, fahrenheit ? "imperial" : "metric",
+	    current_obs.humidity, current_obs.pressure,
+	    current_obs.weather_id, icon, (long long)current_obs.time);
+	if (n >= len)
+		n = len - 1;
+	return n;
 }
 
 void
@@ -453,7 +1545,9 @@ redraw_icon(void)
 	/* update icon and window titles */
 	if (!(rc = XStringListToTextProperty(&titlep, 1, &title_prop)))
 		errx(1, "XStringListToTextProperty");
+	ALLOC_COUNT(title_prop.nitems + 1);
 	XSetWMIconName(xinfo.dpy, xinfo.win, &title_prop);
+	XFree(title_prop.value);
 	XStoreName(xinfo.dpy, xinfo.win, current_conditions);
 
 	xinfo.hints.icon_pixmap = icon_map[icon].pm;
@@ -461,8 +1555,10 @@ redraw_icon(void)
 	xinfo.hints.flags = IconPixmapHint | IconMaskHint;
 	XSetWMHints(xinfo.dpy, xinfo.win, &xinfo.hints);
 
-	/* and draw it in the center of the window */
+	/* and draw it in the center of the window, above any forecast */
 	XGetWindowAttributes(xinfo.dpy, xinfo.win, &xgwa);
+	if (show_forecast)
+		xgwa.height -= FORECAST_HEIGHT;
 	xo = (xgwa.width / 2) - (icon_map[icon].pm_attrs.width / 2);
 	yo = (xgwa.height / 2) - (icon_map[icon].pm_attrs.height / 2);
 	XSetClipMask(xinfo.dpy, xinfo.gc, icon_map[icon].pm_mask);
@@ -474,4 +1570,226 @@ redraw_icon(void)
 	    0, 0,
 	    icon_map[icon].pm_attrs.width, icon_map[icon].pm_attrs.height,
 	    xo, yo);
+
+	if (show_forecast || show_history)
+		XSetClipMask(xinfo.dpy, xinfo.gc, None);
+
+	/* both already rendered, so just one copy each */
+	if (show_forecast)
+		XCopyArea(xinfo.dpy, xinfo.forecast, xinfo.win, xinfo.gc,
+		    0, 0, WINDOW_WIDTH, FORECAST_HEIGHT, 0, xgwa.height);
+	if (show_history)
+		XCopyArea(xinfo.dpy, xinfo.sparkline, xinfo.win, xinfo.gc,
+		    0, 0, WINDOW_WIDTH, SPARK_HEIGHT, 0,
+		    xgwa.height - SPARK_HEIGHT);
+}
+
+#define SPARK_Y(t) (1 + ((spark_hi - (t)) * (SPARK_HEIGHT - 3) / \
+    (spark_hi - spark_lo)))
+
+/*
+ * Add the newest observation to the temperature sparkline along the bottom of
+ * the window.  As long as it fits the current scale, the existing graph is
+ * just shifted left and only the new segment is drawn; it is only redrawn
+ * from scratch when the scale has to grow.
+ */
+void
+update_sparkline(void)
+{
+	static int spark_lo = 0, spark_hi = 0, drawn = 0;
+	XSegment segs[HISTORY_MAX];
+	const struct observation *obs;
+	int i, n, lo, hi, nsegs, x;
+
+	n = history_count();
+	if (n > WINDOW_WIDTH / SPARK_STEP + 1)
+		n = WINDOW_WIDTH / SPARK_STEP + 1;
+	if (n == 0)
+		return;
+
+	/* tenths of a degree */
+	lo = hi = history_get(0)->temp * 10;
+	for (i = 1; i < n; i++) {
+		obs = history_get(i);
+		if (obs->temp * 10 < lo)
+			lo = obs->temp * 10;
+		if (obs->temp * 10 > hi)
+			hi = obs->temp * 10;
+	}
+
+	XSetClipMask(xinfo.dpy, xinfo.gc, None);
+
+	if (drawn && n > 1 && lo >= spark_lo && hi <= spark_hi) {
+		XCopyArea(xinfo.dpy, xinfo.sparkline, xinfo.sparkline,
+		    xinfo.gc, SPARK_STEP, 0, WINDOW_WIDTH - SPARK_STEP,
+		    SPARK_HEIGHT, 0, 0);
+		XSetForeground(xinfo.dpy, xinfo.gc,
+		    WhitePixel(xinfo.dpy, xinfo.screen));
+		XFillRectangle(xinfo.dpy, xinfo.sparkline, xinfo.gc,
+		    WINDOW_WIDTH - SPARK_STEP, 0, SPARK_STEP, SPARK_HEIGHT);
+		XSetForeground(xinfo.dpy, xinfo.gc,
+		    BlackPixel(xinfo.dpy, xinfo.screen));
+		XDrawLine(xinfo.dpy, xinfo.sparkline, xinfo.gc,
+		    WINDOW_WIDTH - 1 - SPARK_STEP,
+		    SPARK_Y((int)(history_get(1)->temp * 10)),
+		    WINDOW_WIDTH - 1, SPARK_Y((int)(history_get(0)->temp * 10)));
+		return;
+	}
+
+	/* leave a degree of headroom so small changes don't rescale */
+	spark_lo = lo - 10;
+	spark_hi = hi + 10;
+	drawn = 1;
+
+	XSetForeground(xinfo.dpy, xinfo.gc,
+	    WhitePixel(xinfo.dpy, xinfo.screen));
+	XFillRectangle(xinfo.dpy, xinfo.sparkline, xinfo.gc, 0, 0,
+	    WINDOW_WIDTH, SPARK_HEIGHT);
+	XSetForeground(xinfo.dpy, xinfo.gc,
+	    BlackPixel(xinfo.dpy, xinfo.screen));
+
+	for (i = 0, nsegs = 0; i < n - 1; i++, nsegs++) {
+		x = WINDOW_WIDTH - 1 - (i * SPARK_STEP);
+		segs[nsegs].x1 = x;
+		segs[nsegs].y1 = SPARK_Y((int)(history_get(i)->temp * 10));
+		segs[nsegs].x2 = x - SPARK_STEP;
+		segs[nsegs].y2 = SPARK_Y((int)(history_get(i + 1)->temp * 10));
+	}
+	if (nsegs)
+		XDrawSegments(xinfo.dpy, xinfo.sparkline, xinfo.gc, segs,
+		    nsegs);
+	else
+		XDrawPoint(xinfo.dpy, xinfo.sparkline, xinfo.gc,
+		    WINDOW_WIDTH - 1, SPARK_Y(lo));
+}
+
+/* scale every icon down into one pixmap so the forecast can copy from it */
+void
+build_atlas(void)
+{
+	XImage *src, *src_mask, *dst, *dst_mask;
+	GC mask_gc;
+	int i, x, y, w, h, n = sizeof(icon_map) / sizeof(icon_map[0]);
+
+	xinfo.atlas = XCreatePixmap(xinfo.dpy, xinfo.win, ICON_SMALL * n,
+	    ICON_SMALL, DefaultDepth(xinfo.dpy, xinfo.screen));
+	xinfo.atlas_mask = XCreatePixmap(xinfo.dpy, xinfo.win, ICON_SMALL * n,
+	    ICON_SMALL, 1);
+	mask_gc = XCreateGC(xinfo.dpy, xinfo.atlas_mask, 0, NULL);
+
+	for (i = 0; i < n; i++) {
+		w = icon_map[i].pm_attrs.width;
+		h = icon_map[i].pm_attrs.height;
+
+		src = XGetImage(xinfo.dpy, icon_map[i].pm, 0, 0, w, h,
+		    AllPlanes, ZPixmap);
+		src_mask = XGetImage(xinfo.dpy, icon_map[i].pm_mask, 0, 0,
+		    w, h, 1, ZPixmap);
+		dst = XGetImage(xinfo.dpy, xinfo.atlas, ICON_SMALL * i, 0,
+		    ICON_SMALL, ICON_SMALL, AllPlanes, ZPixmap);
+		dst_mask = XGetImage(xinfo.dpy, xinfo.atlas_mask,
+		    ICON_SMALL * i, 0, ICON_SMALL, ICON_SMALL, 1, ZPixmap);
+		if (!src || !src_mask || !dst || !dst_mask)
+			errx(1, "XGetImage failed");
+
+		/* nearest neighbor is fine at these sizes */
+		for (y = 0; y < ICON_SMALL; y++) {
+			for (x = 0; x < ICON_SMALL; x++) {
+				XPutPixel(dst, x, y, XGetPixel(src,
+				    x * w / ICON_SMALL, y * h / ICON_SMALL));
+				XPutPixel(dst_mask, x, y, XGetPixel(src_mask,
+				    x * w / ICON_SMALL, y * h / ICON_SMALL));
+			}
+		}
+
+		XPutImage(xinfo.dpy, xinfo.atlas, xinfo.gc, dst, 0, 0,
+		    ICON_SMALL * i, 0, ICON_SMALL, ICON_SMALL);
+		XPutImage(xinfo.dpy, xinfo.atlas_mask, mask_gc, dst_mask, 0, 0,
+		    ICON_SMALL * i, 0, ICON_SMALL, ICON_SMALL);
+
+		XDestroyImage(src);
+		XDestroyImage(src_mask);
+		XDestroyImage(dst);
+		XDestroyImage(dst_mask);
+	}
+
+	XFreeGC(xinfo.dpy, mask_gc);
+}
+
+/*
+ * Draw the forecast strip off-screen: the temperature curve as one batch of
+ * segments, and a small icon for the middle of each day copied out of the
+ * atlas.  This only happens when the forecast changes, redraw_icon just
+ * copies the result.
+ */
+void
+render_forecast(void)
+{
+	struct forecast *fc = &current_forecast;
+	XSegment segs[FORECAST_MAX];
+	enum icon_type type;
+	char label[16];
+	int i, j, x, y, lo, hi, nsegs, icon, curve_top, curve_h;
+
+	XSetClipMask(xinfo.dpy, xinfo.gc, None);
+	XSetForeground(xinfo.dpy, xinfo.gc,
+	    WhitePixel(xinfo.dpy, xinfo.screen));
+	XFillRectangle(xinfo.dpy, xinfo.forecast, xinfo.gc, 0, 0,
+	    WINDOW_WIDTH, FORECAST_HEIGHT);
+	XSetForeground(xinfo.dpy, xinfo.gc,
+	    BlackPixel(xinfo.dpy, xinfo.screen));
+
+	if (fc->count < 2)
+		return;
+
+	lo = hi = fc->temps[0];
+	for (i = 1; i < fc->count; i++) {
+		if (fc->temps[i] < lo)
+			lo = fc->temps[i];
+		if (fc->temps[i] > hi)
+			hi = fc->temps[i];
+	}
+	if (hi == lo)
+		hi = lo + 1;
+
+	curve_top = 2;
+	curve_h = FORECAST_HEIGHT - ICON_SMALL - 6;
+
+	for (i = 0, nsegs = 0; i < fc->count - 1; i++, nsegs++) {
+		segs[nsegs].x1 = i * (WINDOW_WIDTH - 1) / (fc->count - 1);
+		segs[nsegs].y1 = curve_top +
+		    (hi - fc->temps[i]) * curve_h / (hi - lo);
+		segs[nsegs].x2 = (i + 1) * (WINDOW_WIDTH - 1) /
+		    (fc->count - 1);
+		segs[nsegs].y2 = curve_top +
+		    (hi - fc->temps[i + 1]) * curve_h / (hi - lo);
+	}
+	XDrawSegments(xinfo.dpy, xinfo.forecast, xinfo.gc, segs, nsegs);
+
+	snprintf(label, sizeof(label), "%d", hi / 10);
+	XDrawString(xinfo.dpy, xinfo.forecast, xinfo.gc, 1, curve_top + 9,
+	    label, strlen(label));
+
+	/* one icon per day, for the step in the middle of it */
+	for (i = 0; i < fc->count; i += 8) {
+		j = (i + 4 < fc->count) ? i + 4 : i;
+		type = condition_icon(fc->ids[j], (fc->night >> j) & 1);
+		for (icon = 0; icon < sizeof(icon_map) / sizeof(icon_map[0]);
+		    icon++) {
+			if (icon_map[icon].value == type)
+				break;
+		}
+		x = (i + 4) * (WINDOW_WIDTH - 1) / (fc->count - 1) -
+		    (ICON_SMALL / 2);
+		if (x > WINDOW_WIDTH - ICON_SMALL)
+			x = WINDOW_WIDTH - ICON_SMALL;
+		y = FORECAST_HEIGHT - ICON_SMALL - 2;
+
+		XSetClipMask(xinfo.dpy, xinfo.gc, xinfo.atlas_mask);
+		XSetClipOrigin(xinfo.dpy, xinfo.gc, x - (ICON_SMALL * icon),
+		    y);
+		XCopyArea(xinfo.dpy, xinfo.atlas, xinfo.forecast, xinfo.gc,
+		    ICON_SMALL * icon, 0, ICON_SMALL, ICON_SMALL, x, y);
+	}
+	XSetClipMask(xinfo.dpy, xinfo.gc, None);
 }